@@ -0,0 +1,187 @@
+#include "sql_async.h"
+#include "../log/log.h"
+#include <string.h>
+
+#ifdef SQL_NONBLOCK
+#include <mysql/errmsg.h>
+
+static_assert(SQL_WAIT_READ == MYSQL_WAIT_READ &&
+                  SQL_WAIT_WRITE == MYSQL_WAIT_WRITE,
+              "wait flags must match the client library");
+#endif
+
+sql_async::sql_async()
+    : m_conns(NULL), m_conn_number(0), m_alive(0), m_watcher(NULL),
+      m_head(NULL), m_tail(NULL) {}
+
+sql_async::~sql_async() {
+  for (int i = 0; i < m_conn_number; ++i) {
+    if (m_conns[i].mysql) {
+      connection_pool::CloseStmts(&m_conns[i].stmts);
+      mysql_close(m_conns[i].mysql);
+    }
+  }
+  delete[] m_conns;
+}
+
+#ifdef SQL_NONBLOCK
+
+bool sql_async::init(connection_pool *connPool, int conn_number,
+                     sql_watcher *watcher) {
+  m_watcher = watcher;
+  m_conns = new sql_conn[conn_number];
+  for (int i = 0; i < conn_number; ++i) {
+    MYSQL *mysql = connPool->Connect(true);
+    if (!mysql) {
+      break;
+    }
+    /* 预处理也是阻塞的，和建立连接一样只在启动时进行 */
+    if (!connection_pool::Prepare(mysql, &m_conns[m_conn_number].stmts)) {
+      mysql_close(mysql);
+      break;
+    }
+    m_conns[m_conn_number].mysql = mysql;
+    m_conns[m_conn_number].fd = mysql_get_socket(mysql);
+    m_conns[m_conn_number].req = NULL;
+    ++m_conn_number;
+  }
+  m_alive = m_conn_number;
+  return m_conn_number > 0;
+}
+
+void sql_async::submit(sql_request *req) {
+  req->next = NULL;
+  for (int i = 0; i < m_conn_number; ++i) {
+    if (m_conns[i].mysql && !m_conns[i].req) {
+      start(&m_conns[i], req, 1);
+      return;
+    }
+  }
+  if (m_alive == 0) {
+    sql_executor::get_instance()->submit(req);
+    return;
+  }
+  if (m_tail) {
+    m_tail->next = req;
+  } else {
+    m_head = req;
+  }
+  m_tail = req;
+}
+
+bool sql_async::owns(int fd) const {
+  for (int i = 0; i < m_conn_number; ++i) {
+    if (m_conns[i].fd == fd && m_conns[i].mysql) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void sql_async::on_event(int fd, int ready) {
+  for (int i = 0; i < m_conn_number; ++i) {
+    sql_conn *c = &m_conns[i];
+    if (c->fd != fd || !c->mysql || !c->req) {
+      continue;
+    }
+    int err = 0;
+    int status = mysql_stmt_execute_cont(&err, c->stmt, ready);
+    if (status) {
+      m_watcher->watch(c->fd, status & (SQL_WAIT_READ | SQL_WAIT_WRITE));
+    } else {
+      finish(c, err);
+    }
+    return;
+  }
+}
+
+void sql_async::start(sql_conn *c, sql_request *batch, int rows) {
+  c->req = batch;
+  c->rows = rows;
+  c->stmt = connection_pool::StmtOf(&c->stmts, batch->stmt, rows);
+  MYSQL_STMT *stmt = c->stmt;
+  const char *args[SQL_MAX_ARGS * SQL_MAX_BATCH];
+  int arg_number = sql_executor::batch_args(batch, args);
+  int err = 0;
+  int status = 0;
+  if (!connection_pool::BindParams(stmt, args, arg_number)) {
+    err = 1;
+  } else {
+    status = mysql_stmt_execute_start(&err, stmt);
+  }
+  if (status) {
+    /* 没有设置读写超时，不会等待 MYSQL_WAIT_TIMEOUT */
+    m_watcher->watch(c->fd, status & (SQL_WAIT_READ | SQL_WAIT_WRITE));
+  } else {
+    finish(c, err);
+  }
+}
+
+void sql_async::finish(sql_conn *c, int err) {
+  sql_request *batch = c->req;
+  c->req = NULL;
+  int result = 0;
+  if (err) {
+    unsigned int code = mysql_stmt_errno(c->stmt);
+    LOG_ERROR("execute error:%s", mysql_stmt_error(c->stmt));
+    /* 与 connection_pool::Execute 一样返回错误码 */
+    result = code ? code : 1;
+    if (connection_pool::IsLost(code)) {
+      drop(c);
+      result = SQL_UNAVAILABLE;
+    } else if (c->rows > 1) {
+      /* 多行语句整体回滚(如其中一行重名)，由执行线程逐行重新执行，
+       * 标记为单独执行，不会在执行线程中再次合并、再失败一次 */
+      while (batch) {
+        sql_request *next = batch->next;
+        batch->single = true;
+        sql_executor::get_instance()->submit(batch);
+        batch = next;
+      }
+    }
+  }
+  /* 回调之后不再访问这批请求 */
+  sql_executor::complete(batch, result);
+
+  if (!m_head) {
+    return;
+  }
+  if (c->mysql) {
+    int rows = 0;
+    sql_request *next = sql_executor::take_batch(&m_head, &m_tail, &rows);
+    start(c, next, rows);
+  } else if (m_alive == 0) {
+    /* 所有连接都已断开，排队的请求改由执行线程完成 */
+    while (m_head) {
+      sql_request *next = m_head;
+      m_head = next->next;
+      sql_executor::get_instance()->submit(next);
+    }
+    m_tail = NULL;
+  }
+}
+
+void sql_async::drop(sql_conn *c) {
+  m_watcher->watch(c->fd, 0);
+  connection_pool::CloseStmts(&c->stmts);
+  mysql_close(c->mysql);
+  c->mysql = NULL;
+  --m_alive;
+}
+
+#else
+
+bool sql_async::init(connection_pool * /*connPool*/, int /*conn_number*/,
+                     sql_watcher * /*watcher*/) {
+  return false;
+}
+
+void sql_async::submit(sql_request *req) {
+  sql_executor::get_instance()->submit(req);
+}
+
+bool sql_async::owns(int /*fd*/) const { return false; }
+
+void sql_async::on_event(int /*fd*/, int /*ready*/) {}
+
+#endif
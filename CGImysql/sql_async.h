@@ -0,0 +1,86 @@
+#ifndef SQL_ASYNC_H
+#define SQL_ASYNC_H
+
+#include <atomic>
+#include <mysql/mysql.h>
+
+#include "sql_connection_pool.h"
+#include "sql_executor.h"
+
+/* MariaDB Connector/C 提供非阻塞接口(mysql_stmt_execute_start/cont)，
+ * 没有该接口的客户端库(如 MySQL 的 libmysqlclient)只能使用 sql_executor */
+#ifdef MYSQL_WAIT_READ
+#define SQL_NONBLOCK
+#endif
+
+/* 连接等待的事件，取值与 MYSQL_WAIT_READ、MYSQL_WAIT_WRITE 相同 */
+enum SQL_WAIT { SQL_WAIT_READ = 1, SQL_WAIT_WRITE = 2 };
+
+/* 非阻塞连接等待 socket 就绪时由所属的事件循环监听，event_loop 实现该接口 */
+class sql_watcher {
+
+public:
+  virtual ~sql_watcher() {}
+  /* 监听 fd 上的 events(SQL_WAIT_READ/SQL_WAIT_WRITE 的组合)，一次性的，
+   * 就绪后调用 sql_async::on_event；events 为0表示不再监听 */
+  virtual void watch(int fd, int events) = 0;
+};
+
+/* 由事件循环驱动的数据库客户端
+ * 每个事件循环持有几个非阻塞连接，建立时预处理所有语句，连接的 socket 注册在该事件循环的 epoll 或
+ * io_uring 中，语句发出后不等待结果，socket 就绪时继续执行，完成后调用请求的
+ * done 回调，等待数据库的请求既不占用工作线程也不占用执行线程。
+ * 只执行不返回结果集的语句(如注册时的 INSERT)。连接空闲时排队的可合并请求
+ * 与 sql_executor 一样合并成一条多行语句，多行语句失败时交给执行线程逐行重试。
+ * 连接都断开后，尚未执行和之后提交的请求交给 sql_executor。
+ * 除 available 外只能在所属的事件循环线程中调用。
+ */
+class sql_async {
+
+public:
+  sql_async();
+  ~sql_async();
+
+  /* 建立 conn_number 个非阻塞连接(建立连接是阻塞的，只在启动时调用)，
+   * 客户端库不支持或一个连接都没有建立时返回 false */
+  bool init(connection_pool *connPool, int conn_number, sql_watcher *watcher);
+  /* 还有可用的连接，可以由任意线程调用，结果只是一个估计 */
+  bool available() const {
+    return m_alive.load(std::memory_order_relaxed) > 0;
+  }
+  /* 有空闲连接时立即发出，否则排队 */
+  void submit(sql_request *req);
+  /* fd 是否为某个连接的 socket */
+  bool owns(int fd) const;
+  /* fd 上 watch 的事件已就绪，ready 为 SQL_WAIT_READ/SQL_WAIT_WRITE 的组合 */
+  void on_event(int fd, int ready);
+
+private:
+  struct sql_conn {
+    MYSQL *mysql;
+    sql_stmts stmts;
+    int fd;
+    /* 正在执行的一批请求，用 next 串起来，为 NULL 表示空闲 */
+    sql_request *req;
+    int rows;
+    MYSQL_STMT *stmt;
+  };
+
+  /* 在空闲连接 c 上把 rows 个请求作为一条语句发出 */
+  void start(sql_conn *c, sql_request *batch, int rows);
+  /* c 上的语句执行完毕，err 为 mysql_stmt_execute 的返回值 */
+  void finish(sql_conn *c, int err);
+  /* 连接已断开，不再使用 */
+  void drop(sql_conn *c);
+
+private:
+  sql_conn *m_conns;
+  int m_conn_number;
+  std::atomic<int> m_alive;
+  sql_watcher *m_watcher;
+  /* 等待空闲连接的请求，用 sql_request::next 串起来 */
+  sql_request *m_head;
+  sql_request *m_tail;
+};
+
+#endif
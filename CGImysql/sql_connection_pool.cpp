@@ -1,6 +1,8 @@
 #include "sql_connection_pool.h"
+#include "../log/log.h"
 #include <iostream>
 #include <list>
+#include <mysql/errmsg.h>
 #include <mysql/mysql.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -11,8 +13,14 @@
 using namespace std;
 
 connection_pool::connection_pool() {
+  this->MaxConn = 0;
+  this->MinConn = 0;
   this->CurConn = 0;
   this->FreeConn = 0;
+  this->Connecting = 0;
+  this->WaitTimeout = 0;
+  this->RetryAfter = 0;
+  memset(&stats, 0, sizeof(stats));
 }
 
 connection_pool *connection_pool::GetInstance() {
@@ -22,63 +30,299 @@ connection_pool *connection_pool::GetInstance() {
 
 //构造初始化
 void connection_pool::init(string url, string User, string PassWord,
-                           string DBName, int Port, unsigned int MaxConn) {
+                           string DBName, int Port, unsigned int MaxConn,
+                           unsigned int MinConn, int WaitTimeout) {
   /* 初始化数据库信息 */
   this->url = url;
   this->Port = Port;
   this->User = User;
   this->PassWord = PassWord;
   this->DatabaseName = DBName;
+  this->MaxConn = MaxConn > 0 ? MaxConn : 1;
+  this->MinConn = MinConn < this->MaxConn ? MinConn : this->MaxConn;
+  this->WaitTimeout = WaitTimeout;
 
   lock.lock();
-  /* 创建MaxConn数的数据库连接 */
-  for (int i = 0; i < MaxConn; i++) {
-    MYSQL *con = NULL;
-    con = mysql_init(con);
-
-    if (con == NULL) {
-      cout << "Error:" << mysql_error(con);
-      exit(1);
-    }
-    con = mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(),
-                             DBName.c_str(), Port, NULL, 0);
-
+  /* 先创建MinConn数的数据库连接，其余的在需要时创建 */
+  for (unsigned int i = 0; i < this->MinConn; i++) {
+    sql_stmts stmts;
+    MYSQL *con = Open(&stmts);
     if (con == NULL) {
-      cout << "Error: " << mysql_error(con);
+      /* exit 会析构连接池，先释放锁 */
+      lock.unlock();
       exit(1);
     }
 
     /* 更新连接池和空闲连接数量 */
+    conn_info &info = connMap[con];
+    info.stmts = stmts;
+    info.idle_since = time(NULL);
+    info.broken = false;
     connList.push_back(con);
     ++FreeConn;
   }
 
-  /* 信号量初始化为最大空闲数 */
-  reserve = sem(FreeConn);
+  lock.unlock();
+}
+
+MYSQL *connection_pool::Connect(bool nonblock) {
+  MYSQL *con = mysql_init(NULL);
+  if (con == NULL) {
+    cout << "Error: mysql_init failure";
+    return NULL;
+  }
+#ifdef MYSQL_WAIT_READ
+  /* MariaDB Connector/C 的非阻塞接口，建立连接本身仍是阻塞的 */
+  if (nonblock) {
+    mysql_options(con, MYSQL_OPT_NONBLOCK, 0);
+  }
+#endif
+  /* 数据库无响应时不让工作线程无限期阻塞 */
+  unsigned int timeout = CONNECT_TIMEOUT;
+  mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+  if (!nonblock) {
+    timeout = IO_TIMEOUT;
+    mysql_options(con, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(con, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+  }
+  if (!mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(),
+                          DatabaseName.c_str(), Port, NULL, 0)) {
+    cout << "Error: " << mysql_error(con);
+    mysql_close(con);
+    return NULL;
+  }
+  return con;
+}
+
+/* 按 SQL_STMT 索引的语句，rows 行的语句为 head 之后接 rows 个以逗号分隔的 row */
+static const struct {
+  const char *head;
+  const char *row;
+  bool batch;
+} stmt_defs[STMT_NUMBER] = {
+    {"INSERT INTO user(username, passwd) VALUES", "(?, ?)", true}};
+
+static MYSQL_STMT *prepare_rows(MYSQL *conn, SQL_STMT id, int rows) {
+  string sql = stmt_defs[id].head;
+  for (int i = 0; i < rows; ++i) {
+    sql += i ? ", " : "";
+    sql += stmt_defs[id].row;
+  }
+  MYSQL_STMT *stmt = mysql_stmt_init(conn);
+  if (stmt && mysql_stmt_prepare(stmt, sql.c_str(), sql.size())) {
+    cout << "Error: prepare " << sql << ": " << mysql_error(conn);
+    mysql_stmt_close(stmt);
+    stmt = NULL;
+  }
+  return stmt;
+}
+
+bool connection_pool::Prepare(MYSQL *conn, sql_stmts *stmts) {
+  memset(stmts, 0, sizeof(*stmts));
+  for (int i = 0; i < STMT_NUMBER; ++i) {
+    SQL_STMT id = (SQL_STMT)i;
+    stmts->stmt[i] = prepare_rows(conn, id, 1);
+    if (!stmts->stmt[i]) {
+      CloseStmts(stmts);
+      return false;
+    }
+    for (int rows = 2; CanBatch(id) && rows <= SQL_MAX_BATCH; ++rows) {
+      stmts->batch[i][rows] = prepare_rows(conn, id, rows);
+      if (!stmts->batch[i][rows]) {
+        CloseStmts(stmts);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void connection_pool::CloseStmts(sql_stmts *stmts) {
+  for (int i = 0; i < STMT_NUMBER; ++i) {
+    if (stmts->stmt[i]) {
+      mysql_stmt_close(stmts->stmt[i]);
+      stmts->stmt[i] = NULL;
+    }
+    for (int rows = 2; rows <= SQL_MAX_BATCH; ++rows) {
+      if (stmts->batch[i][rows]) {
+        mysql_stmt_close(stmts->batch[i][rows]);
+        stmts->batch[i][rows] = NULL;
+      }
+    }
+  }
+}
 
-  this->MaxConn = FreeConn;
+MYSQL_STMT *connection_pool::StmtOf(sql_stmts *stmts, SQL_STMT id, int rows) {
+  if (rows == 1) {
+    return stmts->stmt[id];
+  }
+  return rows > 1 && rows <= SQL_MAX_BATCH ? stmts->batch[id][rows] : NULL;
+}
+
+bool connection_pool::CanBatch(SQL_STMT id) { return stmt_defs[id].batch; }
+
+bool connection_pool::BindParams(MYSQL_STMT *stmt, const char **args,
+                                 int arg_number) {
+  if (arg_number > SQL_MAX_ARGS * SQL_MAX_BATCH) {
+    return false;
+  }
+  MYSQL_BIND binds[SQL_MAX_ARGS * SQL_MAX_BATCH];
+  memset(binds, 0, sizeof(binds));
+  for (int i = 0; i < arg_number; ++i) {
+    /* length 为空时以 buffer_length 作为参数长度 */
+    binds[i].buffer_type = MYSQL_TYPE_STRING;
+    binds[i].buffer = (void *)args[i];
+    binds[i].buffer_length = strlen(args[i]);
+  }
+  return mysql_stmt_bind_param(stmt, binds) == 0;
+}
 
+bool connection_pool::IsLost(unsigned int code) {
+  return code == CR_SERVER_GONE_ERROR || code == CR_SERVER_LOST;
+}
+
+MYSQL_STMT *connection_pool::GetStmt(MYSQL *conn, SQL_STMT id, int rows) {
+  MYSQL_STMT *stmt = NULL;
+  lock.lock();
+  map<MYSQL *, conn_info>::iterator it = connMap.find(conn);
+  if (it != connMap.end()) {
+    stmt = StmtOf(&it->second.stmts, id, rows);
+  }
   lock.unlock();
+  return stmt;
 }
 
-//当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
-MYSQL *connection_pool::GetConnection() {
-  MYSQL *con = NULL;
+int connection_pool::Execute(MYSQL *conn, SQL_STMT id, const char **args,
+                             int arg_number, int rows) {
+  MYSQL_STMT *stmt = GetStmt(conn, id, rows);
+  if (!stmt) {
+    return 1;
+  }
+  if (!BindParams(stmt, args, arg_number) || mysql_stmt_execute(stmt)) {
+    int err = mysql_stmt_errno(stmt);
+    if (IsLost(err)) {
+      /* 语句可能已经提交，不换连接重试，归还时关闭这个连接 */
+      lock.lock();
+      connMap[conn].broken = true;
+      lock.unlock();
+      return SQL_UNAVAILABLE;
+    }
+    return err ? err : 1;
+  }
+  return 0;
+}
 
-  if (0 == connList.size())
+MYSQL *connection_pool::Open(sql_stmts *stmts) {
+  MYSQL *con = Connect();
+  if (con == NULL) {
     return NULL;
+  }
+  if (!Prepare(con, stmts)) {
+    mysql_close(con);
+    return NULL;
+  }
+  return con;
+}
+
+void connection_pool::Close(MYSQL *conn, sql_stmts *stmts) {
+  CloseStmts(stmts);
+  mysql_close(conn);
+}
+
+int64_t connection_pool::NowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-  /* 取出操作信号量 - 1 */
-  reserve.wait();
+//当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
+MYSQL *connection_pool::GetConnection() {
+  MYSQL *con = NULL;
+  int64_t start = NowUs();
+  int64_t deadline = start + (int64_t)WaitTimeout * 1000;
+  bool waited = false;
 
   lock.lock();
+  ++stats.acquires;
+  while (true) {
+    if (!connList.empty()) {
+      /* 后进先出，常用的连接保持活跃，不常用的连接留在头部等待空闲超时 */
+      con = connList.back();
+      connList.pop_back();
+      --FreeConn;
+      ++CurConn;
+      if (time(NULL) - connMap[con].idle_since < PING_INTERVAL) {
+        break;
+      }
+
+      /* 空闲较久的连接可能已被服务端关闭，在锁外检查 */
+      lock.unlock();
+      bool alive = mysql_ping(con) == 0;
+      lock.lock();
+      if (alive) {
+        break;
+      }
+      sql_stmts stmts = connMap[con].stmts;
+      connMap.erase(con);
+      --CurConn;
+      ++stats.broken;
+      lock.unlock();
+      LOG_WARN("%s", "drop a dead sql connection");
+      Close(con, &stmts);
+      lock.lock();
+      con = NULL;
+      continue;
+    }
 
-  con = connList.front();
-  connList.pop_front();
+    int64_t now = NowUs();
+    if (CurConn + FreeConn + Connecting < MaxConn && now >= RetryAfter) {
+      /* 没有空闲连接且未达上限，在锁外新建一个 */
+      ++Connecting;
+      lock.unlock();
+      sql_stmts stmts;
+      con = Open(&stmts);
+      lock.lock();
+      --Connecting;
+      if (con) {
+        conn_info &info = connMap[con];
+        info.stmts = stmts;
+        info.broken = false;
+        ++CurConn;
+        break;
+      }
+      ++stats.connect_failures;
+      RetryAfter = NowUs() + (int64_t)RETRY_INTERVAL * 1000;
+      LOG_ERROR("%s", "sql connect failure");
+      /* 其他等待者也不会再尝试，唤醒它们重新判断 */
+      available.broadcast();
+      now = NowUs();
+    }
+
+    /* 等待超时，或者数据库不可用且没有会被归还的连接时立即失败 */
+    if (now >= deadline || (now < RetryAfter && CurConn + Connecting == 0)) {
+      ++stats.timeouts;
+      break;
+    }
 
-  --FreeConn;
-  ++CurConn;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t wait_ns = (deadline - now) * 1000 + ts.tv_nsec;
+    ts.tv_sec += wait_ns / 1000000000;
+    ts.tv_nsec = wait_ns % 1000000000;
+    waited = true;
+    ++stats.waiting;
+    available.timewait(lock.get(), ts);
+    --stats.waiting;
+  }
 
+  if (waited) {
+    unsigned long long wait = NowUs() - start;
+    ++stats.waits;
+    stats.wait_us += wait;
+    if (wait > stats.max_wait_us) {
+      stats.max_wait_us = wait;
+    }
+  }
   lock.unlock();
   return con;
 }
@@ -88,16 +332,42 @@ bool connection_pool::ReleaseConnection(MYSQL *con) {
   if (NULL == con)
     return false;
 
-  lock.lock();
+  MYSQL *closing = NULL;
+  sql_stmts stmts;
+  time_t now = time(NULL);
 
-  connList.push_back(con);
-  ++FreeConn;
+  lock.lock();
   --CurConn;
+  conn_info &info = connMap[con];
+  if (info.broken) {
+    closing = con;
+    stmts = info.stmts;
+    connMap.erase(con);
+    ++stats.broken;
+  } else {
+    info.idle_since = now;
+    connList.push_back(con);
+    ++FreeConn;
 
+    /* 连接数超过下限时关闭空闲最久且超时的一个 */
+    MYSQL *oldest = connList.front();
+    conn_info &old = connMap[oldest];
+    if (CurConn + FreeConn > MinConn && now - old.idle_since >= IDLE_TIMEOUT) {
+      closing = oldest;
+      stmts = old.stmts;
+      connList.pop_front();
+      --FreeConn;
+      connMap.erase(oldest);
+    }
+  }
+
+  /* 归还了连接或空出了名额，唤醒一个等待者 */
+  available.signal();
   lock.unlock();
 
-  /* 释放操作 信号量 + 1 */
-  reserve.post();
+  if (closing) {
+    Close(closing, &stmts);
+  }
   return true;
 }
 
@@ -105,27 +375,29 @@ bool connection_pool::ReleaseConnection(MYSQL *con) {
 void connection_pool::DestroyPool() {
 
   lock.lock();
-  if (connList.size() > 0) {
-	
-    /* 通过迭代器依次删除数据库连接 */
-    list<MYSQL *>::iterator it;
-    for (it = connList.begin(); it != connList.end(); ++it) {
-      MYSQL *con = *it;
-      mysql_close(con);
-    }
-    CurConn = 0;
-    FreeConn = 0;
-    connList.clear();
-
-    lock.unlock();
+  /* 通过迭代器依次删除数据库连接，此时所有连接都应已归还 */
+  map<MYSQL *, conn_info>::iterator it;
+  for (it = connMap.begin(); it != connMap.end(); ++it) {
+    Close(it->first, &it->second.stmts);
   }
-
+  connMap.clear();
+  CurConn = 0;
+  FreeConn = 0;
+  connList.clear();
   lock.unlock();
 }
 
 //当前空闲的连接数
 int connection_pool::GetFreeConn() { return this->FreeConn; }
 
+void connection_pool::GetStats(pool_stats *stats) {
+  lock.lock();
+  *stats = this->stats;
+  stats->total = CurConn + FreeConn;
+  stats->in_use = CurConn;
+  lock.unlock();
+}
+
 connection_pool::~connection_pool() { DestroyPool(); }
 
 connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool) {
@@ -3,6 +3,9 @@
 
 #include <stdio.h>
 #include <list>
+#include <map>
+#include <stdint.h>
+#include <time.h>
 #include <mysql/mysql.h>
 #include <error.h>
 #include <string.h>
@@ -12,35 +15,108 @@
 
 using namespace std;
 
+#define SQL_MAX_ARGS 4 //预处理语句参数的最大个数
+#define SQL_MAX_BATCH 16 //可合并的语句一次最多合并的行数
+#define SQL_UNAVAILABLE -1 //没有可用的连接或连接在执行中断开，数据库暂时不可用
+
+/* 预处理语句，每个连接建立时预处理一次，之后只用二进制协议发送参数 */
+enum SQL_STMT
+{
+	STMT_INSERT_USER = 0, //INSERT INTO user(username, passwd) VALUES(?, ?)，可合并
+	STMT_NUMBER
+};
+
+/* 一个连接上预处理好的语句，按 SQL_STMT 索引
+ * 可合并的 INSERT 还预处理了 2 到 SQL_MAX_BATCH 行的多行版本，
+ * 多个请求合并成一条语句，一次往返、一次提交 */
+struct sql_stmts
+{
+	MYSQL_STMT *stmt[STMT_NUMBER];
+	MYSQL_STMT *batch[STMT_NUMBER][SQL_MAX_BATCH + 1]; //下标为行数，0和1不用
+};
+
+/* 连接池的统计，由 GetStats 取得某一时刻的快照 */
+struct pool_stats
+{
+	unsigned int total;				//已建立的连接数
+	unsigned int in_use;			//正在使用的连接数
+	unsigned int waiting;			//正在等待连接的请求数
+	unsigned long acquires;			//获取连接的次数
+	unsigned long waits;			//需要等待的次数
+	unsigned long long wait_us;		//累计等待时间(微秒)
+	unsigned long long max_wait_us; //最长的一次等待时间(微秒)
+	unsigned long timeouts;			//等待超时或数据库不可用而获取失败的次数
+	unsigned long connect_failures; //建立连接失败的次数
+	unsigned long broken;			//检查或执行时发现已断开而关闭的连接数
+};
+
 class connection_pool
 {
 public:
-	MYSQL *GetConnection();				 //获取数据库连接
+	static const int PING_INTERVAL = 30;	//空闲超过该时间(秒)的连接取出时先 ping
+	static const int IDLE_TIMEOUT = 60;		//超过最小连接数的连接空闲该时间(秒)后关闭
+	static const int RETRY_INTERVAL = 1000; //建立连接失败后该时间(毫秒)内不再尝试
+	static const int CONNECT_TIMEOUT = 2;	//建立连接的超时(秒)
+	static const int IO_TIMEOUT = 5;		//阻塞连接读写的超时(秒)
+
+	MYSQL *GetConnection();				 //获取数据库连接，等待超时或数据库不可用时返回NULL
 	bool ReleaseConnection(MYSQL *conn); //释放连接
 	int GetFreeConn();					 //获取连接
+	void GetStats(pool_stats *stats);	 //连接池统计的快照
+	MYSQL *Connect(bool nonblock = false); //用连接池的配置新建一个不属于连接池的连接，失败返回NULL
+	MYSQL_STMT *GetStmt(MYSQL *conn, SQL_STMT id, int rows = 1); //连接池中的连接上预处理好的 rows 行语句
+	int Execute(MYSQL *conn, SQL_STMT id, const char **args, int arg_number, int rows = 1); //执行语句，args为所有行的参数，成功返回0，连接断开返回SQL_UNAVAILABLE，否则返回错误码
 	void DestroyPool();					 //销毁所有连接
 
 	//单例模式
 	static connection_pool *GetInstance();
 
-	void init(string url, string User, string PassWord, string DataBaseName, int Port, unsigned int MaxConn); 
+	static bool Prepare(MYSQL *conn, sql_stmts *stmts);	//在conn上预处理所有语句
+	static void CloseStmts(sql_stmts *stmts);			//关闭预处理的语句
+	static MYSQL_STMT *StmtOf(sql_stmts *stmts, SQL_STMT id, int rows); //rows 行的语句，不可合并时只有1行
+	static bool CanBatch(SQL_STMT id);					//语句是否可以多行合并
+	static bool BindParams(MYSQL_STMT *stmt, const char **args, int arg_number); //以字符串绑定参数，args在执行完之前必须有效
+	static bool IsLost(unsigned int code);				//错误码是否表示连接已断开
+
+	/* 启动时建立 MinConn 个连接，之后按需增加到 MaxConn 个；
+	 * 没有空闲连接时最多等待 WaitTimeout 毫秒 */
+	void init(string url, string User, string PassWord, string DataBaseName, int Port, unsigned int MaxConn, unsigned int MinConn, int WaitTimeout);
 	
 	connection_pool();
 	~connection_pool();
 
 private:
-	unsigned int MaxConn;  //最大连接数
-	unsigned int CurConn;  //当前已使用的连接数
-	unsigned int FreeConn; //当前空闲的连接数
+	/* 连接池中一个连接的信息 */
+	struct conn_info
+	{
+		sql_stmts stmts;   //预处理好的语句
+		time_t idle_since; //放回连接池的时间
+		bool broken;	   //执行时发现已断开，归还时关闭
+	};
+
+	MYSQL *Open(sql_stmts *stmts); //建立连接并预处理语句，不加锁
+	static void Close(MYSQL *conn, sql_stmts *stmts); //关闭语句和连接，不加锁
+	static int64_t NowUs();
+
+private:
+	unsigned int MaxConn;	 //最大连接数
+	unsigned int MinConn;	 //最小连接数，空闲超时不会关闭到它以下
+	unsigned int CurConn;	 //当前已使用的连接数
+	unsigned int FreeConn;	 //当前空闲的连接数
+	unsigned int Connecting; //正在建立的连接数
+	int WaitTimeout;		 //获取连接最多等待的时间(毫秒)
+	int64_t RetryAfter;		 //建立连接失败后，到该时间(微秒)之前不再尝试
 
 private:
 	locker lock;
-	list<MYSQL *> connList; //连接池
-	sem reserve;
+	cond available;			//归还或关闭连接时唤醒一个等待者
+	list<MYSQL *> connList; //空闲连接，最近归还的在尾部
+	map<MYSQL *, conn_info> connMap; //所有已建立的连接，加锁访问
+	pool_stats stats;
 
 private:
 	string url;			 //主机地址
-	string Port;		 //数据库端口号
+	int Port;			 //数据库端口号
 	string User;		 //登陆数据库用户名
 	string PassWord;	 //登陆数据库密码
 	string DatabaseName; //使用数据库名
@@ -0,0 +1,192 @@
+#include "sql_executor.h"
+#include "../log/log.h"
+#include <mysql/mysql.h>
+
+sql_executor::sql_executor()
+    : m_connPool(NULL), m_threads(NULL), m_thread_number(0), m_head(NULL),
+      m_tail(NULL), m_stop(false) {}
+
+sql_executor::~sql_executor() { stop(); }
+
+bool sql_executor::init(connection_pool *connPool, int thread_number) {
+  if (thread_number <= 0) {
+    return false;
+  }
+  m_connPool = connPool;
+  m_threads = new pthread_t[thread_number];
+  for (int i = 0; i < thread_number; ++i) {
+    if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
+      stop();
+      return false;
+    }
+    ++m_thread_number;
+  }
+  return true;
+}
+
+void sql_executor::submit(sql_request *req) {
+  req->next = NULL;
+  m_queuelocker.lock();
+  if (m_stop) {
+    m_queuelocker.unlock();
+    complete(req, SQL_UNAVAILABLE);
+    return;
+  }
+  if (m_tail) {
+    m_tail->next = req;
+  } else {
+    m_head = req;
+  }
+  m_tail = req;
+  m_queuecond.signal();
+  m_queuelocker.unlock();
+}
+
+void sql_executor::stop() {
+  m_queuelocker.lock();
+  m_stop = true;
+  m_queuecond.broadcast();
+  m_queuelocker.unlock();
+  for (int i = 0; i < m_thread_number; ++i) {
+    pthread_join(m_threads[i], NULL);
+  }
+  m_thread_number = 0;
+  delete[] m_threads;
+  m_threads = NULL;
+
+  /* 阻塞在 execute 中的线程需要被唤醒 */
+  m_queuelocker.lock();
+  sql_request *rest = m_head;
+  m_head = m_tail = NULL;
+  m_queuelocker.unlock();
+  complete(rest, SQL_UNAVAILABLE);
+}
+
+void *sql_executor::worker(void *arg) {
+  sql_executor *executor = (sql_executor *)arg;
+  executor->run();
+  return executor;
+}
+
+void sql_executor::run() {
+  while (true) {
+    m_queuelocker.lock();
+    while (!m_head && !m_stop) {
+      m_queuecond.wait(m_queuelocker.get());
+    }
+    if (m_stop) {
+      m_queuelocker.unlock();
+      return;
+    }
+    int rows = 0;
+    sql_request *batch = take_batch(&m_head, &m_tail, &rows);
+    m_queuelocker.unlock();
+
+    {
+      MYSQL *mysql = NULL;
+      connectionRAII mysqlcon(&mysql, m_connPool);
+      execute_batch(mysql, batch, rows);
+    }
+    /* 连接归还之后再回调 */
+    for (sql_request *req = batch; req;) {
+      sql_request *next = req->next;
+      req->done(req);
+      req = next;
+    }
+  }
+}
+
+void sql_executor::execute_batch(MYSQL *mysql, sql_request *batch, int rows) {
+  if (!mysql) {
+    for (sql_request *req = batch; req; req = req->next) {
+      req->result = SQL_UNAVAILABLE;
+    }
+    return;
+  }
+
+  const char *args[SQL_MAX_ARGS * SQL_MAX_BATCH];
+  int arg_number = batch_args(batch, args);
+  int result = m_connPool->Execute(mysql, batch->stmt, args, arg_number, rows);
+  if (result == 0 || result == SQL_UNAVAILABLE || rows == 1) {
+    if (result) {
+      LOG_ERROR("execute error:%d", result);
+    }
+    for (sql_request *req = batch; req; req = req->next) {
+      req->result = result;
+    }
+    return;
+  }
+
+  /* 多行语句整体回滚(如其中一行重名)，逐行重新执行，每个请求得到自己的结果 */
+  for (sql_request *req = batch; req; req = req->next) {
+    req->result =
+        m_connPool->Execute(mysql, req->stmt, req->args, req->arg_number);
+    if (req->result) {
+      LOG_ERROR("execute error:%d", req->result);
+    }
+  }
+}
+
+sql_request *sql_executor::take_batch(sql_request **head, sql_request **tail,
+                                      int *rows) {
+  sql_request *batch = *head;
+  sql_request *last = batch;
+  *rows = 1;
+  if (!batch->single && connection_pool::CanBatch(batch->stmt)) {
+    while (*rows < SQL_MAX_BATCH && last->next && !last->next->single &&
+           last->next->stmt == batch->stmt &&
+           last->next->arg_number == batch->arg_number) {
+      last = last->next;
+      ++*rows;
+    }
+  }
+  *head = last->next;
+  if (!*head) {
+    *tail = NULL;
+  }
+  last->next = NULL;
+  return batch;
+}
+
+int sql_executor::batch_args(sql_request *batch, const char **args) {
+  int n = 0;
+  for (sql_request *req = batch; req; req = req->next) {
+    for (int i = 0; i < req->arg_number; ++i) {
+      args[n++] = req->args[i];
+    }
+  }
+  return n;
+}
+
+void sql_executor::complete(sql_request *batch, int result) {
+  while (batch) {
+    sql_request *next = batch->next;
+    batch->result = result;
+    batch->done(batch);
+    batch = next;
+  }
+}
+
+/* execute 在栈上提交的请求，回调时唤醒等待的线程 */
+struct blocking_request : sql_request {
+  sem finished;
+
+  static void on_done(sql_request *req) {
+    static_cast<blocking_request *>(req)->finished.post();
+  }
+};
+
+int sql_executor::execute(SQL_STMT stmt, const char **args, int arg_number) {
+  blocking_request req;
+  req.stmt = stmt;
+  for (int i = 0; i < arg_number; ++i) {
+    req.args[i] = args[i];
+  }
+  req.arg_number = arg_number;
+  req.single = false;
+  req.result = SQL_UNAVAILABLE;
+  req.done = blocking_request::on_done;
+  submit(&req);
+  req.finished.wait();
+  return req.result;
+}
@@ -0,0 +1,79 @@
+#ifndef SQL_EXECUTOR_H
+#define SQL_EXECUTOR_H
+
+#include <pthread.h>
+
+#include "../lock/locker.h"
+#include "sql_connection_pool.h"
+
+/* 一条等待执行的语句，由提交者分配，完成回调之前必须保持有效 */
+struct sql_request {
+  /* 要执行的预处理语句及其字符串参数 */
+  SQL_STMT stmt;
+  const char *args[SQL_MAX_ARGS];
+  int arg_number;
+  /* 只单独执行，不与其他请求合并；多行语句失败后逐行重试的请求设置 */
+  bool single;
+  /* 成功为0，没有可用连接或连接断开时为 SQL_UNAVAILABLE，否则为错误码 */
+  int result;
+  /* 在执行线程中调用，之后执行器不再访问该请求 */
+  void (*done)(sql_request *req);
+  sql_request *next;
+};
+
+/* 数据库执行器
+ * 由少量专用线程执行阻塞的语句，提交查询的工作线程不必等待，可以去处理其他请求，
+ * 上千个等待数据库的请求只占用与执行线程数相同的数据库连接。
+ * 每次执行时才从连接池获取连接，执行完立即归还。
+ * 组提交：执行线程取请求时，把队首连续的同一条可合并语句(如注册的 INSERT)
+ * 一起取走，最多 SQL_MAX_BATCH 个，合并成一条多行语句执行，一次往返、一次提交，
+ * 提交之后才逐个回调；数据库越忙，排队的请求越多，每批合并的也越多。
+ */
+class sql_executor {
+
+public:
+  static sql_executor *get_instance() {
+    static sql_executor instance;
+    return &instance;
+  }
+
+  /* 创建 thread_number 个执行线程，线程越少每批合并的请求越多 */
+  bool init(connection_pool *connPool, int thread_number);
+  /* 由任意线程调用，把请求放入队列 */
+  void submit(sql_request *req);
+  /* 提交语句并阻塞到它所在的批次执行完，返回 sql_request::result */
+  int execute(SQL_STMT stmt, const char **args, int arg_number);
+
+  /* 从链表 head 的队首取出可以合并执行的请求，rows 返回个数，
+   * 取出的请求仍用 next 串起来；sql_async 也用它合并排队的请求 */
+  static sql_request *take_batch(sql_request **head, sql_request **tail,
+                                 int *rows);
+  /* 把一批请求的参数依次放入 args，返回参数总数 */
+  static int batch_args(sql_request *batch, const char **args);
+  /* 设置一批请求的结果并逐个回调 */
+  static void complete(sql_request *batch, int result);
+  /* 结束并回收执行线程，队列中尚未执行和之后提交的请求以 SQL_UNAVAILABLE 完成 */
+  void stop();
+
+private:
+  sql_executor();
+  ~sql_executor();
+
+  static void *worker(void *arg);
+  void run();
+  /* 在 mysql 上执行一批请求，设置每个请求的结果 */
+  void execute_batch(MYSQL *mysql, sql_request *batch, int rows);
+
+private:
+  connection_pool *m_connPool;
+  pthread_t *m_threads;
+  int m_thread_number;
+  locker m_queuelocker;
+  cond m_queuecond;
+  /* 先进先出的请求链表，用 sql_request::next 串起来 */
+  sql_request *m_head;
+  sql_request *m_tail;
+  bool m_stop;
+};
+
+#endif
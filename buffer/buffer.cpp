@@ -0,0 +1,160 @@
+#include "buffer.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+buffer::buffer(size_t initial_size)
+    : m_data(NULL), m_capacity(0), m_initial_size(initial_size),
+      m_reader_index(CHEAP_PREPEND), m_writer_index(CHEAP_PREPEND) {}
+
+buffer::~buffer() {
+  if (m_data) {
+    buffer_pool::get_instance()->deallocate(m_data, m_capacity);
+  }
+}
+
+size_t buffer::writable_bytes() const {
+  return m_capacity > m_writer_index ? m_capacity - m_writer_index : 0;
+}
+
+char *buffer::peek() { return m_data ? m_data + m_reader_index : NULL; }
+
+char *buffer::begin_write() { return m_data ? m_data + m_writer_index : NULL; }
+
+void buffer::retrieve(size_t len) {
+  if (len < readable_bytes()) {
+    m_reader_index += len;
+  } else {
+    retrieve_all();
+  }
+}
+
+void buffer::retrieve_all() {
+  m_reader_index = CHEAP_PREPEND;
+  m_writer_index = CHEAP_PREPEND;
+}
+
+void buffer::append(const char *data, size_t len) {
+  ensure_writable(len);
+  memcpy(begin_write(), data, len);
+  m_writer_index += len;
+}
+
+void buffer::prepend(const void *data, size_t len) {
+  assert(len <= prependable_bytes());
+  m_reader_index -= len;
+  memcpy(peek(), data, len);
+}
+
+void buffer::ensure_writable(size_t len) {
+  if (writable_bytes() < len) {
+    make_space(len);
+  }
+}
+
+void buffer::release() {
+  if (m_data && readable_bytes() == 0) {
+    buffer_pool::get_instance()->deallocate(m_data, m_capacity);
+    m_data = NULL;
+    m_capacity = 0;
+    retrieve_all();
+  }
+}
+
+void buffer::make_space(size_t len) {
+  size_t readable = readable_bytes();
+  if (m_data && writable_bytes() + prependable_bytes() >= len + CHEAP_PREPEND) {
+    /* 把可读数据移到前面，腾出已读部分的空间 */
+    memmove(m_data + CHEAP_PREPEND, peek(), readable);
+    m_reader_index = CHEAP_PREPEND;
+    m_writer_index = m_reader_index + readable;
+    return;
+  }
+
+  /* 整理后仍然不够，按倍数扩容以减少后续的复制，内存池按2的幂向上取整 */
+  size_t size = m_capacity * 2;
+  if (size < CHEAP_PREPEND + readable + len) {
+    size = CHEAP_PREPEND + readable + len;
+  }
+  if (size < m_initial_size) {
+    size = m_initial_size;
+  }
+  char *data = buffer_pool::get_instance()->allocate(&size);
+  if (m_data) {
+    memcpy(data + CHEAP_PREPEND, peek(), readable);
+    buffer_pool::get_instance()->deallocate(m_data, m_capacity);
+  }
+  m_data = data;
+  m_capacity = size;
+  m_reader_index = CHEAP_PREPEND;
+  m_writer_index = m_reader_index + readable;
+}
+
+ssize_t buffer::read_fd(int fd, int *saved_errno) {
+  char extrabuf[EXTRA_BUFFER_SIZE];
+  struct iovec vec[2];
+  const size_t writable = writable_bytes();
+  vec[0].iov_base = begin_write();
+  vec[0].iov_len = writable;
+  vec[1].iov_base = extrabuf;
+  vec[1].iov_len = sizeof(extrabuf);
+  /* 可写空间足够大时不使用溢出区 */
+  const int iovcnt = (writable < sizeof(extrabuf)) ? 2 : 1;
+  const ssize_t n = readv(fd, vec, iovcnt);
+  if (n < 0) {
+    *saved_errno = errno;
+  } else if ((size_t)n <= writable) {
+    m_writer_index += n;
+  } else {
+    m_writer_index += writable;
+    append(extrabuf, n - writable);
+  }
+  return n;
+}
+
+chain_buffer::chain_buffer(size_t block_size) : m_block_size(block_size) {}
+
+chain_buffer::~chain_buffer() { clear(); }
+
+chain_buffer::block &chain_buffer::tail(size_t len) {
+  if (m_blocks.empty() || m_blocks.back().size - m_blocks.back().used < len) {
+    block b;
+    b.size = len > m_block_size ? len : m_block_size;
+    b.data = buffer_pool::get_instance()->allocate(&b.size);
+    b.used = 0;
+    m_blocks.push_back(b);
+  }
+  return m_blocks.back();
+}
+
+char *chain_buffer::append_format(int *len, const char *format,
+                                  va_list arg_list) {
+  va_list arg_copy;
+  va_copy(arg_copy, arg_list);
+
+  block *b = &tail(1);
+  int ret = vsnprintf(b->data + b->used, b->size - b->used, format, arg_list);
+  if (ret >= 0 && (size_t)ret >= b->size - b->used) {
+    /* 当前块放不下，换一个足够大的新块重新格式化 */
+    b = &tail(ret + 1);
+    ret = vsnprintf(b->data + b->used, b->size - b->used, format, arg_copy);
+  }
+  va_end(arg_copy);
+  if (ret < 0) {
+    return NULL;
+  }
+
+  char *data = b->data + b->used;
+  b->used += ret;
+  *len = ret;
+  return data;
+}
+
+void chain_buffer::clear() {
+  for (size_t i = 0; i < m_blocks.size(); ++i) {
+    buffer_pool::get_instance()->deallocate(m_blocks[i].data, m_blocks[i].size);
+  }
+  m_blocks.clear();
+}
@@ -0,0 +1,108 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "buffer_pool.h"
+
+using namespace std;
+
+/* 可增长的连续缓冲区，用作连接的读缓冲
+ *
+ * +-------------------+------------------+------------------+
+ * | prependable bytes |  readable bytes  |  writable bytes  |
+ * +-------------------+------------------+------------------+
+ * 0      <=      reader_index   <=   writer_index    <=    size
+ *
+ * 空间在第一次写入时才从 buffer_pool 分配，不够时先把可读数据移到前面，仍不够再扩容，
+ * 因此扩容或整理后 peek() 返回的地址可能改变，调用者只应保存偏移
+ */
+class buffer {
+
+public:
+  /* 头部预留的空间，可以在已有数据之前追加内容而不移动数据 */
+  static const size_t CHEAP_PREPEND = 8;
+  /* read_fd 使用的栈上溢出区大小 */
+  static const size_t EXTRA_BUFFER_SIZE = 65536;
+
+  explicit buffer(size_t initial_size = 1024);
+  ~buffer();
+
+  size_t readable_bytes() const { return m_writer_index - m_reader_index; }
+  size_t writable_bytes() const;
+  size_t prependable_bytes() const { return m_reader_index; }
+
+  /* 可读数据的起始位置，尚未分配空间时为 NULL */
+  char *peek();
+  /* 可写空间的起始位置 */
+  char *begin_write();
+  void has_written(size_t len) { m_writer_index += len; }
+
+  /* 丢弃前 len 个字节的可读数据 */
+  void retrieve(size_t len);
+  void retrieve_all();
+
+  void append(const char *data, size_t len);
+  /* 在可读数据之前插入，len 不能超过 prependable_bytes() */
+  void prepend(const void *data, size_t len);
+  /* 保证至少有 len 字节的可写空间 */
+  void ensure_writable(size_t len);
+  /* 没有可读数据时把空间归还内存池 */
+  void release();
+
+  /* 用 readv 读取一次，可写空间不足时先读到栈上的溢出区再追加，
+   * 一次系统调用即可读完内核中的数据，且不必为每个连接预留大缓冲 */
+  ssize_t read_fd(int fd, int *saved_errno);
+
+private:
+  /* 禁止复制，空间由一个对象独占 */
+  buffer(const buffer &);
+  buffer &operator=(const buffer &);
+
+  void make_space(size_t len);
+
+private:
+  char *m_data;
+  size_t m_capacity;
+  size_t m_initial_size;
+  size_t m_reader_index;
+  size_t m_writer_index;
+};
+
+/* 由固定大小的块串起来的缓冲区，用作连接的写缓冲
+ * 追加时已写入的数据从不移动，每次追加的内容都可以直接作为 iovec 交给 writev，
+ * 当前块放不下时从 buffer_pool 分配新块，内容大于块大小时新块按内容大小分配
+ */
+class chain_buffer {
+
+public:
+  explicit chain_buffer(size_t block_size = 1024);
+  ~chain_buffer();
+
+  /* 追加格式化字符串，返回写入的位置，len 为写入的长度，失败返回 NULL */
+  char *append_format(int *len, const char *format, va_list arg_list);
+  /* 清空内容，所有块归还内存池 */
+  void clear();
+
+private:
+  chain_buffer(const chain_buffer &);
+  chain_buffer &operator=(const chain_buffer &);
+
+  struct block {
+    char *data;
+    size_t size;
+    size_t used;
+  };
+
+  /* 保证最后一个块至少有 len 字节的空间 */
+  block &tail(size_t len);
+
+private:
+  vector<block> m_blocks;
+  size_t m_block_size;
+};
+
+#endif
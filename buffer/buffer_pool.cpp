@@ -0,0 +1,65 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+buffer_pool::buffer_pool() {
+  for (int i = 0; i < CLASS_NUMBER; ++i) {
+    m_classes[i].free_list = NULL;
+  }
+}
+
+int buffer_pool::size_class(size_t size) {
+  for (int i = 0; i < CLASS_NUMBER; ++i) {
+    if (size <= ((size_t)1 << (MIN_SHIFT + i))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+char *buffer_pool::allocate(size_t *size) {
+  int index = size_class(*size);
+  if (index == -1) {
+    return (char *)malloc(*size);
+  }
+
+  size_t block_size = (size_t)1 << (MIN_SHIFT + index);
+  pool_class &c = m_classes[index];
+  c.lock.lock();
+  if (!c.free_list) {
+    /* 空闲链表为空，申请一个 slab 切成同样大小的块 */
+    char *slab = (char *)malloc(SLAB_SIZE);
+    if (!slab) {
+      c.lock.unlock();
+      return NULL;
+    }
+    for (size_t off = 0; off + block_size <= SLAB_SIZE; off += block_size) {
+      free_block *b = (free_block *)(slab + off);
+      b->next = c.free_list;
+      c.free_list = b;
+    }
+  }
+  free_block *b = c.free_list;
+  c.free_list = b->next;
+  c.lock.unlock();
+
+  *size = block_size;
+  return (char *)b;
+}
+
+void buffer_pool::deallocate(char *p, size_t size) {
+  if (!p) {
+    return;
+  }
+  int index = size_class(size);
+  if (index == -1) {
+    free(p);
+    return;
+  }
+
+  pool_class &c = m_classes[index];
+  free_block *b = (free_block *)p;
+  c.lock.lock();
+  b->next = c.free_list;
+  c.free_list = b;
+  c.lock.unlock();
+}
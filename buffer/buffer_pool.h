@@ -0,0 +1,54 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+#include "../lock/locker.h"
+
+/* 连接读写缓冲使用的内存池
+ * 按 1KB 到 64KB 的2的幂分成若干大小级别，每个级别从一次分配的大块(slab)中
+ * 切出同样大小的内存块，释放的块挂在该级别的空闲链表上供下次使用，
+ * 超过最大级别的请求直接使用 malloc
+ * 连接只在处理请求期间持有缓冲，空闲的长连接不占用缓冲内存
+ */
+class buffer_pool {
+
+public:
+  static buffer_pool *get_instance() {
+    static buffer_pool instance;
+    return &instance;
+  }
+
+  /* 分配至少 *size 字节，*size 返回实际可用的大小 */
+  char *allocate(size_t *size);
+  /* 归还 allocate 得到的内存，size 为 allocate 返回的大小 */
+  void deallocate(char *p, size_t size);
+
+private:
+  buffer_pool();
+  ~buffer_pool() {}
+
+  /* size 所属的级别，超过最大级别时返回 -1 */
+  static int size_class(size_t size);
+
+private:
+  static const int MIN_SHIFT = 10;
+  static const int MAX_SHIFT = 16;
+  static const int CLASS_NUMBER = MAX_SHIFT - MIN_SHIFT + 1;
+  /* 每次向系统申请的大块大小 */
+  static const size_t SLAB_SIZE = 256 * 1024;
+
+  /* 空闲块的前几个字节用作链表指针 */
+  struct free_block {
+    free_block *next;
+  };
+
+  struct pool_class {
+    locker lock;
+    free_block *free_list;
+  };
+
+  pool_class m_classes[CLASS_NUMBER];
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include "file_cache.h"
+#include "../log/log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <pthread.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* 任何会让已缓存的 stat 结果、描述符或映射过时的事件 */
+#define WATCH_MASK                                                             \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |            \
+   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+file_entry::~file_entry() {
+  if (m_addr) {
+    munmap(m_addr, st.st_size);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+char *file_entry::map() {
+  m_lock.lock();
+  if (!m_addr && fd != -1 && st.st_size > 0) {
+    void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      m_addr = (char *)addr;
+    }
+  }
+  char *addr = m_addr;
+  m_lock.unlock();
+  return addr;
+}
+
+file_cache::file_cache()
+    : m_max_entries_per_shard(0), m_enabled(false), m_generation(0),
+      m_inotifyfd(-1) {}
+
+file_cache::~file_cache() {
+  if (m_inotifyfd != -1) {
+    close(m_inotifyfd);
+  }
+}
+
+bool file_cache::init(const char *root, int max_entries) {
+  m_max_entries_per_shard = max_entries / SHARD_NUMBER;
+  if (m_max_entries_per_shard <= 0) {
+    m_max_entries_per_shard = 1;
+  }
+
+  m_inotifyfd = inotify_init1(IN_CLOEXEC);
+  if (m_inotifyfd == -1) {
+    LOG_ERROR("%s:errno is:%d", "inotify_init error, file cache disabled",
+              errno);
+    return false;
+  }
+  add_watch(root);
+  if (m_watches.empty()) {
+    LOG_ERROR("%s", "watch doc_root failed, file cache disabled");
+    return false;
+  }
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, watch_thread, this) != 0) {
+    return false;
+  }
+  pthread_detach(tid);
+  m_enabled = true;
+  return true;
+}
+
+void file_cache::add_watch(const string &dir) {
+  int wd = inotify_add_watch(m_inotifyfd, dir.c_str(),
+                             WATCH_MASK | IN_ONLYDIR);
+  if (wd == -1) {
+    LOG_ERROR("inotify_add_watch %s error:%d", dir.c_str(), errno);
+    return;
+  }
+  m_watches[wd] = dir;
+
+  DIR *dp = opendir(dir.c_str());
+  if (!dp) {
+    return;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(dp)) != NULL) {
+    if (ent->d_type != DT_DIR || strcmp(ent->d_name, ".") == 0 ||
+        strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    add_watch(dir + "/" + ent->d_name);
+  }
+  closedir(dp);
+}
+
+void *file_cache::watch_thread(void *arg) {
+  ((file_cache *)arg)->watch();
+  return NULL;
+}
+
+void file_cache::watch() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    int len = read(m_inotifyfd, buf, sizeof(buf));
+    if (len <= 0) {
+      if (len == -1 && errno == EINTR) {
+        continue;
+      }
+      /* 无法继续监视，关闭缓存以免返回过时内容 */
+      LOG_ERROR("%s", "inotify read error, file cache disabled");
+      m_enabled = false;
+      invalidate_all();
+      return;
+    }
+
+    for (char *p = buf; p < buf + len;) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        invalidate_all();
+        continue;
+      }
+      map<int, string>::iterator it = m_watches.find(event->wd);
+      if (it == m_watches.end()) {
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        m_watches.erase(it);
+        continue;
+      }
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        /* 整个目录被删除或移动，其下所有路径都可能改变 */
+        invalidate_all();
+        continue;
+      }
+      if (event->len == 0) {
+        continue;
+      }
+
+      string path = it->second + "/" + event->name;
+      if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          add_watch(path);
+        }
+        invalidate_all();
+      } else {
+        invalidate(path);
+      }
+    }
+  }
+}
+
+void file_cache::invalidate(const string &path) {
+  ++m_generation;
+  shard &s = m_shards[hash<string>()(path) % SHARD_NUMBER];
+  s.lock.lock();
+  s.entries.erase(path);
+  s.lock.unlock();
+}
+
+void file_cache::invalidate_all() {
+  ++m_generation;
+  for (int i = 0; i < SHARD_NUMBER; ++i) {
+    m_shards[i].lock.lock();
+    m_shards[i].entries.clear();
+    m_shards[i].lock.unlock();
+  }
+}
+
+file_ref file_cache::load(const char *path) {
+  file_ref entry = make_shared<file_entry>();
+  if (stat(path, &entry->st) < 0) {
+    entry->err = errno;
+    return entry;
+  }
+  if (S_ISREG(entry->st.st_mode)) {
+    entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  return entry;
+}
+
+file_ref file_cache::get(const char *path) {
+  if (!m_enabled) {
+    return load(path);
+  }
+
+  string key(path);
+  shard &s = m_shards[hash<string>()(key) % SHARD_NUMBER];
+  s.lock.lock();
+  unordered_map<string, file_ref>::iterator it = s.entries.find(key);
+  if (it != s.entries.end()) {
+    file_ref entry = it->second;
+    s.lock.unlock();
+    return entry;
+  }
+  s.lock.unlock();
+
+  unsigned long generation = m_generation;
+  file_ref entry = load(path);
+
+  s.lock.lock();
+  if (generation == m_generation) {
+    /* 条目过多时随意淘汰一个，主要用于限制不存在路径的负缓存 */
+    if ((int)s.entries.size() >= m_max_entries_per_shard) {
+      s.entries.erase(s.entries.begin());
+    }
+    pair<unordered_map<string, file_ref>::iterator, bool> ret =
+        s.entries.insert(make_pair(key, entry));
+    /* 其他线程已经加载过同一个文件，使用先加入缓存的条目 */
+    entry = ret.first->second;
+  }
+  s.lock.unlock();
+  return entry;
+}
@@ -0,0 +1,93 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#include "../lock/locker.h"
+
+using namespace std;
+
+/* 缓存的一个文件：stat 结果、只读描述符和按需建立的内存映射
+ * 不存在的文件也会缓存(负缓存)，err 为 stat 失败时的 errno
+ * 条目一旦创建便不再修改(除懒加载的映射外)，失效时只从缓存中移除，
+ * 正在使用它发送应答的连接通过 shared_ptr 保证描述符和映射在发送完之前有效
+ */
+class file_entry {
+
+public:
+  file_entry() : err(0), fd(-1), m_addr(NULL) {}
+  ~file_entry();
+
+  /* 获取整个文件的只读映射，第一次调用时建立 */
+  char *map();
+
+public:
+  int err;
+  struct stat st;
+  int fd;
+
+private:
+  locker m_lock;
+  char *m_addr;
+};
+
+typedef shared_ptr<file_entry> file_ref;
+
+/* 文档根目录下的文件缓存，以完整路径为键
+ * 按路径哈希分片，每片一把锁，未命中时在锁外完成 stat/open
+ * 后台线程通过 inotify 监视整个目录树，文件被修改、删除或创建时使对应条目失效
+ */
+class file_cache {
+
+public:
+  static file_cache *get_instance() {
+    static file_cache instance;
+    return &instance;
+  }
+
+  /* 监视 root 目录树并启用缓存，失败时缓存关闭，get 每次都直接访问文件系统 */
+  bool init(const char *root, int max_entries = 4096);
+
+  /* 获取 path 对应的缓存条目，未命中时打开文件并加入缓存 */
+  file_ref get(const char *path);
+
+  /* 是否正在监视目录树，为假时条目不会失效也不会被缓存 */
+  bool enabled() const { return m_enabled; }
+
+private:
+  file_cache();
+  ~file_cache();
+
+  static void *watch_thread(void *arg);
+  void watch();
+  /* 递归监视 dir 及其子目录 */
+  void add_watch(const string &dir);
+  void invalidate(const string &path);
+  void invalidate_all();
+  file_ref load(const char *path);
+
+private:
+  static const int SHARD_NUMBER = 16;
+
+  struct shard {
+    locker lock;
+    unordered_map<string, file_ref> entries;
+  };
+
+  shard m_shards[SHARD_NUMBER];
+  int m_max_entries_per_shard;
+  atomic<bool> m_enabled;
+
+  /* 每次失效加一，未命中的加载过程中发生失效时不写入缓存，避免缓存旧内容 */
+  atomic<unsigned long> m_generation;
+
+  int m_inotifyfd;
+  map<int, string> m_watches; /* inotify 监视描述符 -> 目录，仅后台线程访问 */
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "response_cache.h"
+#include <errno.h>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+response_cache::response_cache() : m_budget_per_shard(0), m_max_file_size(0) {
+  for (int i = 0; i < SHARD_NUMBER; ++i) {
+    m_shards[i].used = 0;
+  }
+}
+
+void response_cache::init(size_t budget, size_t max_file_size) {
+  m_budget_per_shard = budget / SHARD_NUMBER;
+  m_max_file_size = max_file_size;
+}
+
+response_ref response_cache::build(const file_ref &file,
+                                   const char *content_type) {
+  shared_ptr<cached_response> response = make_shared<cached_response>();
+  response->file = file;
+
+  /* 文件描述符由文件缓存共享，用 pread 读取不影响文件偏移 */
+  response->body.resize(file->st.st_size);
+  size_t have_read = 0;
+  while (have_read < response->body.size()) {
+    ssize_t len = pread(file->fd, &response->body[have_read],
+                        response->body.size() - have_read, have_read);
+    if (len <= 0) {
+      if (len == -1 && errno == EINTR) {
+        continue;
+      }
+      /* 文件在 stat 之后被截断或读取出错，交给普通路径处理 */
+      return response_ref();
+    }
+    have_read += len;
+  }
+
+  /* 与 http_conn::add_status_line/add_headers 生成的应答头完全相同 */
+  char buf[256];
+  for (int linger = 0; linger < 2; ++linger) {
+    int len = snprintf(
+        buf, sizeof(buf),
+        "%s %d %s\r\nContent-Length: %d\r\nContent-Type:%s\r\nConnection:%s\r\n\r\n",
+        "HTTP/1.1", 200, "OK", (int)file->st.st_size, content_type,
+        linger ? "keep-alive" : "close");
+    response->header[linger].assign(buf, len);
+  }
+  return response;
+}
+
+response_ref response_cache::get(const char *path, const file_ref &file,
+                                 const char *content_type) {
+  /* 文件缓存关闭时无法得知文件是否改变，不缓存应答 */
+  if (m_budget_per_shard == 0 || !file_cache::get_instance()->enabled() ||
+      file->st.st_size == 0 ||
+      (size_t)file->st.st_size > m_max_file_size) {
+    return response_ref();
+  }
+
+  string key(path);
+  shard &s = m_shards[hash<string>()(key) % SHARD_NUMBER];
+  s.lock.lock();
+  unordered_map<string, lru_list::iterator>::iterator it = s.index.find(key);
+  if (it != s.index.end()) {
+    response_ref response = it->second->second;
+    if (response->file == file) {
+      /* 命中，移到LRU表头 */
+      s.lru.splice(s.lru.begin(), s.lru, it->second);
+      s.lock.unlock();
+      return response;
+    }
+    /* 文件已经改变，丢弃旧的应答 */
+    s.used -= response->size();
+    s.lru.erase(it->second);
+    s.index.erase(it);
+  }
+  s.lock.unlock();
+
+  /* 在锁外复制文件内容 */
+  response_ref response = build(file, content_type);
+  if (!response || response->size() > m_budget_per_shard) {
+    return response;
+  }
+
+  s.lock.lock();
+  if (s.index.find(key) == s.index.end()) {
+    s.lru.push_front(make_pair(key, response));
+    s.index[key] = s.lru.begin();
+    s.used += response->size();
+    /* 超出预算时从LRU表尾淘汰 */
+    while (s.used > m_budget_per_shard) {
+      s.used -= s.lru.back().second->size();
+      s.index.erase(s.lru.back().first);
+      s.lru.pop_back();
+    }
+  }
+  s.lock.unlock();
+  return response;
+}
@@ -0,0 +1,72 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "../lock/locker.h"
+#include "file_cache.h"
+
+using namespace std;
+
+/* 一个小文件的完整应答：状态行和头部按是否保持连接各备一份，文件内容只存一份
+ * 生成后不再修改，命中时直接把 header 和 body 作为两个内存块交给 writev
+ */
+struct cached_response {
+  file_ref file;     /* 生成应答时的文件缓存条目，条目失效重建后应答随之过期 */
+  string header[2];  /* [0] Connection:close，[1] Connection:keep-alive */
+  string body;
+
+  size_t size() const {
+    return header[0].size() + header[1].size() + body.size();
+  }
+};
+
+typedef shared_ptr<const cached_response> response_ref;
+
+/* 热点小文件的应答缓存
+ * 按路径哈希分片，每片维护一个LRU链表和各自的内存预算，超出预算时淘汰最久未用的应答
+ */
+class response_cache {
+
+public:
+  static response_cache *get_instance() {
+    static response_cache instance;
+    return &instance;
+  }
+
+  /* budget 为所有应答占用内存的上限，max_file_size 为可缓存的最大文件，
+   * budget 为0时关闭缓存 */
+  void init(size_t budget, size_t max_file_size);
+
+  /* 获取 path 的应答，file 为本次请求从文件缓存得到的条目
+   * 未命中或 file 已不是生成应答时的条目时重新生成，文件不适合缓存时返回空 */
+  response_ref get(const char *path, const file_ref &file,
+                   const char *content_type);
+
+private:
+  response_cache();
+  ~response_cache() {}
+
+  response_ref build(const file_ref &file, const char *content_type);
+
+private:
+  static const int SHARD_NUMBER = 16;
+
+  typedef list<pair<string, response_ref> > lru_list;
+
+  struct shard {
+    locker lock;
+    lru_list lru; /* 表头为最近使用 */
+    unordered_map<string, lru_list::iterator> index;
+    size_t used;
+  };
+
+  shard m_shards[SHARD_NUMBER];
+  size_t m_budget_per_shard;
+  size_t m_max_file_size;
+};
+
+#endif
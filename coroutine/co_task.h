@@ -0,0 +1,92 @@
+#ifndef CO_TASK_H
+#define CO_TASK_H
+
+#ifdef USE_COROUTINE
+
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <stddef.h>
+
+/* 协程帧的线程本地缓存
+ * 每个请求都在一个协程中处理，协程帧的大小相同，释放的帧留在释放它的线程中，
+ * 下次创建协程时直接复用，不必每个请求调用一次 malloc。
+ * 协程可能在一个线程中创建、在另一个线程中结束，每个线程最多缓存 MAX_CACHED 个帧。
+ */
+class frame_cache {
+
+public:
+  static void *alloc(size_t size) {
+    cache &c = local();
+    if (c.head && c.size == size) {
+      node *n = c.head;
+      c.head = n->next;
+      --c.count;
+      return n;
+    }
+    return ::operator new(size);
+  }
+
+  static void free(void *frame, size_t size) {
+    cache &c = local();
+    if (c.count == 0) {
+      c.size = size;
+    }
+    if (c.size == size && c.count < MAX_CACHED) {
+      node *n = static_cast<node *>(frame);
+      n->next = c.head;
+      c.head = n;
+      ++c.count;
+      return;
+    }
+    ::operator delete(frame);
+  }
+
+private:
+  static const int MAX_CACHED = 64;
+
+  struct node {
+    node *next;
+  };
+  struct cache {
+    node *head = nullptr;
+    size_t size = 0;
+    int count = 0;
+    ~cache() {
+      while (head) {
+        node *n = head;
+        head = n->next;
+        ::operator delete(n);
+      }
+    }
+  };
+
+  static cache &local() {
+    static thread_local cache c;
+    return c;
+  }
+};
+
+/* 不返回结果、创建后立即执行的协程
+ * 调用者不等待协程结束：协程在第一次挂起时返回调用者，由它等待的操作完成后恢复，
+ * 执行完毕后自动销毁协程帧。等待期间协程帧由等待的对象(如 http_conn)持有，
+ * 需要放弃时由持有者调用 destroy。
+ */
+struct co_task {
+  struct promise_type {
+    co_task get_return_object() { return co_task(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    static void *operator new(size_t size) { return frame_cache::alloc(size); }
+    static void operator delete(void *frame, size_t size) {
+      frame_cache::free(frame, size);
+    }
+  };
+};
+
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#include "conn_table.h"
+#include <sys/resource.h>
+
+conn_table::conn_table() : m_pages(NULL), m_page_number(0), m_max_fd(0) {}
+
+/* 进程退出时页中的连接可能还引用着内存池和文件缓存，这些单例可能已先于
+ * 连接表析构，因此不逐页释放，由进程退出统一回收 */
+conn_table::~conn_table() {}
+
+bool conn_table::init() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+    return false;
+  }
+  if (limit.rlim_cur < limit.rlim_max) {
+    struct rlimit raised = limit;
+    raised.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+      limit = raised;
+    }
+  }
+  m_max_fd = (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > FD_LIMIT)
+                 ? FD_LIMIT
+                 : (int)limit.rlim_cur;
+
+  /* 只为页指针分配空间，100万个描述符也只需要 128KB */
+  m_page_number = (m_max_fd + PAGE_SIZE - 1) / PAGE_SIZE;
+  m_pages = new page *[m_page_number]();
+  return true;
+}
+
+http_conn *conn_table::acquire(int fd) {
+  if (fd < 0 || fd >= m_max_fd) {
+    return NULL;
+  }
+  int index = fd >> PAGE_SHIFT;
+  m_lock.lock();
+  if (!m_pages[index]) {
+    /* 值初始化，client_data 清零 */
+    m_pages[index] = new page();
+  }
+  ++m_pages[index]->used;
+  m_lock.unlock();
+  return conn(fd);
+}
+
+void conn_table::release(int fd) {
+  m_lock.lock();
+  --m_pages[fd >> PAGE_SHIFT]->used;
+  m_lock.unlock();
+}
+
+void conn_table::shrink() {
+  m_lock.lock();
+  for (int i = 0; i < m_page_number; ++i) {
+    if (m_pages[i] && m_pages[i]->used == 0) {
+      delete m_pages[i];
+      m_pages[i] = NULL;
+    }
+  }
+  m_lock.unlock();
+}
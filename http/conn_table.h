@@ -0,0 +1,66 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include "../lock/locker.h"
+#include "../timer/lst_timer.h"
+#include "http_conn.h"
+
+/* 按描述符索引的连接表
+ * 描述符按 PAGE_SIZE 个一组分页，某页第一次有连接时才分配该页的 http_conn 和
+ * client_data，页内连接全部关闭后由定时任务回收，内存随实际并发连接数增长，
+ * 而不是在启动时按描述符上限一次分配。描述符上限取自 RLIMIT_NOFILE。
+ *
+ * 分配和回收页时加锁，按描述符查找不加锁：只查找已经 acquire 且尚未 release
+ * 的描述符，它所在的页不会被回收。
+ */
+class conn_table {
+
+public:
+  static conn_table *get_instance() {
+    static conn_table instance;
+    return &instance;
+  }
+
+  /* 把软限制提高到硬限制，并以此作为描述符上限 */
+  bool init();
+  int max_fd() const { return m_max_fd; }
+
+  /* 新连接使用 fd，所在页不存在时分配，失败返回 NULL */
+  http_conn *acquire(int fd);
+  /* fd 已经关闭，调用之后不能再访问该描述符对应的连接 */
+  void release(int fd);
+
+  http_conn *conn(int fd) const {
+    return &m_pages[fd >> PAGE_SHIFT]->conns[fd & (PAGE_SIZE - 1)];
+  }
+  client_data *data(int fd) const {
+    return &m_pages[fd >> PAGE_SHIFT]->data[fd & (PAGE_SIZE - 1)];
+  }
+
+  /* 回收没有连接的页，由事件循环的定时任务调用，
+   * 连接数在页边界附近抖动时不会反复分配和释放 */
+  void shrink();
+
+private:
+  conn_table();
+  ~conn_table();
+
+private:
+  static const int PAGE_SHIFT = 6;
+  static const int PAGE_SIZE = 1 << PAGE_SHIFT;
+  /* RLIMIT_NOFILE 为无限时使用的上限 */
+  static const int FD_LIMIT = 1 << 20;
+
+  struct page {
+    http_conn conns[PAGE_SIZE];
+    client_data data[PAGE_SIZE];
+    int used; /* 页内正在使用的描述符数 */
+  };
+
+  page **m_pages;
+  int m_page_number;
+  int m_max_fd;
+  locker m_lock;
+};
+
+#endif
@@ -1,8 +1,9 @@
 #include "http_conn.h"
 #include "../log/log.h"
+#include "user_table.h"
 #include <fstream>
-#include <map>
 #include <mysql/mysql.h>
+#include <vector>
 
 //#define CONNFDET //边缘触发非阻塞
 #define CONNFDLT //水平触发阻塞
@@ -24,14 +25,13 @@ const char *error_404_form =
 const char *error_500_title = "Internal Error";
 const char *error_500_form =
     "There was an unusual problem serving the requested file. \n";
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form =
+    "The database is temporarily unavailable, please try again later. \n";
 
 /* 网站根目录 */
 const char *doc_root = "/home/lxc/coding/myProject/LinuxWebServer/root";
 
-//将表中的用户名和密码放入map
-map<string, string> users;
-locker m_lock;
-
 void http_conn::initmysql_result(connection_pool *connPool) {
   //先从连接池中取一个连接
   MYSQL *mysql = NULL;
@@ -51,12 +51,18 @@ void http_conn::initmysql_result(connection_pool *connPool) {
   //返回所有字段结构的数组
   MYSQL_FIELD *fields = mysql_fetch_fields(result);
 
-  //从结果集中获取下一行，将对应的用户名和密码，存入map中
+  //从结果集中获取下一行，将对应的用户名和密码一次批量放入用户表
+  //结果集释放之前各行的内容一直有效
+  vector<const char *> names, passwords;
   while (MYSQL_ROW row = mysql_fetch_row(result)) {
-    string temp1(row[0]);
-    string temp2(row[1]);
-    users[temp1] = temp2;
+    names.push_back(row[0]);
+    passwords.push_back(row[1]);
+  }
+  if (!names.empty()) {
+    user_table::get_instance()->insert_batch(&names[0], &passwords[0],
+                                             names.size());
   }
+  mysql_free_result(result);
 }
 
 int setnonblocking(int fd) {
@@ -102,81 +108,131 @@ void modfd(int epollfd, int fd, int ev) {
   epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+std::atomic<int> http_conn::m_user_count(0);
+int http_conn::m_sendfile_threshold = http_conn::SENDFILE_THRESHOLD;
 
 void http_conn::close_conn(bool real_close) {
+  if (real_close && m_owner) {
+    /* 由事件循环线程关闭，以便同时撤销该连接上未完成的I/O */
+    m_owner->close(this);
+    return;
+  }
   if (real_close && (m_sockfd != -1)) {
-    removefd(m_epollfd, m_sockfd);
-    m_sockfd = -1;
-    m_user_count--; /* 关闭一个连接时，客户数量减一 */
+    /* 只关闭读写，由事件循环在 EPOLLHUP 时关闭描述符并删除定时器，
+     * 连接表中的位置也在那时归还 */
+    shutdown(m_sockfd, SHUT_RDWR);
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
   }
 }
 
-void http_conn::init(int sockfd, const sockaddr_in &addr) {
+void http_conn::release_buffers() {
+#ifdef USE_COROUTINE
+  /* 等待数据库期间连接到期，查询已经完成，放弃挂起的协程 */
+  if (m_coro) {
+    m_coro.destroy();
+    m_coro = nullptr;
+  }
+#endif
+  m_read_buf.retrieve_all();
+  m_read_buf.release();
+  m_write_buf.clear();
+  unmap();
+}
+
+void http_conn::init(int sockfd, const sockaddr_in &addr, int epollfd,
+                     conn_owner *owner) {
   m_sockfd = sockfd;
   m_address = addr;
+  m_epollfd = epollfd;
+  m_owner = owner;
+  /* 上一个使用该描述符的连接可能在发送中途被关闭 */
+  unmap();
   /* 下面两行是为了避免TIME——WAIT状态，仅用于调试，实际使用需要去掉 */
   // int error = 0;
   // socklen_t len = sizeof( error );
   // getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
   // int reuse = 1;
   // setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-  addfd(m_epollfd, sockfd, true);
+  if (m_epollfd != -1) {
+    addfd(m_epollfd, sockfd, true);
+  }
   m_user_count++;
   init();
 }
 
 void http_conn::init() {
-  mysql = NULL;
+  m_checked_idx = 0;
+  m_content_length = 0;
+  m_keep_alive = false;
+  m_pending = false;
+  m_read_buf.retrieve_all();
+  init_request();
+  init_write();
+}
+
+void http_conn::init_request() {
+  /* 已处理的请求占据读缓冲的 [0, m_checked_idx)，之后的数据是客户端
+   * 流水线发送的后续请求，移到读缓冲开头 */
+  if (m_content_length != 0 && m_check_state == CHECK_STATE_CONTENT) {
+    m_read_buf.peek()[m_checked_idx] = m_content_end;
+  }
+  m_read_buf.retrieve(m_checked_idx);
+  /* 没有后续请求时读缓冲归还内存池，空闲的长连接不占用缓冲 */
+  m_read_buf.release();
+  m_checked_idx = 0;
+  m_start_line = 0;
+
   m_check_state = CHECK_STATE_REQUESTLINE;
   m_linger = false;
   m_method = GET;
+  m_class = REQUEST_STATIC;
   m_url = 0;
+  m_url_idx = 0;
   m_version = 0;
   m_content_length = 0;
   m_host = 0;
-  m_start_line = 0;
-  m_checked_idx = 0;
-  m_read_idx = 0;
-  m_write_idx = 0;
   cgi = 0;
+  memset(m_real_file, '\0', FILENAME_LEN);
+}
+
+void http_conn::init_write() {
+  m_write_buf.clear();
+  m_iv_count = 0;
   bytes_have_send = 0;
   bytes_to_send = 0;
-  memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-  memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-  memset(m_real_file, '\0', FILENAME_LEN);
 }
 
 /* 从状态机 */
 http_conn::LINE_STATUS http_conn::parse_line() {
   char temp;
+  char *buf = m_read_buf.peek();
+  int read_idx = m_read_buf.readable_bytes();
   /* m_checked_idx
-   * 指向buffer（读缓存）中正在分析的字节，m_read_idx指向buffer中客户数据尾部的下一个字节
+   * 指向buffer（读缓存）中正在分析的字节，read_idx指向buffer中客户数据尾部的下一个字节
    */
-  for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
+  for (; m_checked_idx < read_idx; ++m_checked_idx) {
     /* 获取当前要分析的字节 */
-    temp = m_read_buf[m_checked_idx];
+    temp = buf[m_checked_idx];
     /* 如果当前的字节是 \r （回车符）则说明可能是一个完整的行 */
     if (temp == '\r') {
       /* 如果 \r
        * 字符碰巧是目前buffer中最后一个已经被读入的客户数据，则表示本次没有获取一个完整的行，需要进一步分析
        */
-      if ((m_checked_idx + 1) == m_read_idx) {
+      if ((m_checked_idx + 1) == read_idx) {
         return LINE_OPEN;
       } /* 如果下一个字符 \n 则表示读取到一个完整的行 */
-      else if (m_read_buf[m_checked_idx + 1] == '\n') {
-        m_read_buf[m_checked_idx++] = '\0';
-        m_read_buf[m_checked_idx++] = '\0';
+      else if (buf[m_checked_idx + 1] == '\n') {
+        buf[m_checked_idx++] = '\0';
+        buf[m_checked_idx++] = '\0';
         return LINE_OK;
       }
       /* 否则表示请求语法有问题 */
       return LINE_BAD;
     } /* 如果当前字符是 \n 则也可能读取到一个完整的行 */
     else if (temp == '\n') {
-      if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')) {
-        m_read_buf[m_checked_idx - 1] = '\0';
-        m_read_buf[m_checked_idx++] = '\0';
+      if ((m_checked_idx > 1) && (buf[m_checked_idx - 1] == '\r')) {
+        buf[m_checked_idx - 1] = '\0';
+        buf[m_checked_idx++] = '\0';
         return LINE_OK;
       }
       return LINE_BAD;
@@ -190,44 +246,76 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 
 /* 循环读取客户端数据，知道无数据可读或者对方关闭连接 */
 bool http_conn::read() {
-  if (m_read_idx >= READ_BUFFER_SIZE) {
+  /* 请求超过上限仍不完整，不再继续接收 */
+  if (m_read_buf.readable_bytes() >= READ_BUFFER_LIMIT) {
     return false;
   }
 
   int bytes_read = 0;
+  int saved_errno = 0;
 
 #ifdef CONNFDLT
 
-  bytes_read =
-      recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+  bytes_read = m_read_buf.read_fd(m_sockfd, &saved_errno);
 
   if (bytes_read <= 0) {
     return false;
   }
-
-  m_read_idx += bytes_read;
+  /* 留出一个字节，供 parse_content 在请求体末尾写入结束符 */
+  m_read_buf.ensure_writable(1);
 
   return true;
 
 #endif
 
-#ifdef connfdET
-  while (true) {
-    bytes_read = recv(m_sockfd, m_read_buf + m_read_idx,
-                      READ_BUFFER_SIZE - m_read_idx, 0);
+#ifdef CONNFDET
+  while (m_read_buf.readable_bytes() < READ_BUFFER_LIMIT) {
+    bytes_read = m_read_buf.read_fd(m_sockfd, &saved_errno);
     if (bytes_read == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      if (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK)
         break;
       return false;
     } else if (bytes_read == 0) {
       return false;
     }
-    m_read_idx += bytes_read;
   }
+  m_read_buf.ensure_writable(1);
   return true;
 #endif
 }
 
+http_conn::REQUEST_CLASS http_conn::classify() {
+  /* 请求行已经解析过，正在接收同一个请求的请求头或请求体 */
+  if (m_check_state != CHECK_STATE_REQUESTLINE) {
+    return m_class;
+  }
+  m_class = REQUEST_STATIC;
+  const char *text = m_read_buf.peek();
+  size_t len = m_read_buf.readable_bytes();
+  if (!text || len < 5 || strncasecmp(text, "POST", 4) != 0) {
+    return m_class;
+  }
+  /* 与 do_request 相同：POST 且 URL 最后一段以 2(登录) 或 3(注册) 开头 */
+  const char *end = (const char *)memchr(text, '\n', len);
+  if (!end) {
+    end = text + len;
+  }
+  const char *url = text + 4;
+  while (url < end && (*url == ' ' || *url == '\t')) {
+    ++url;
+  }
+  const char *last = NULL;
+  for (const char *c = url; c < end && *c != ' ' && *c != '\t'; ++c) {
+    if (*c == '/') {
+      last = c;
+    }
+  }
+  if (last && last + 1 < end && (last[1] == '2' || last[1] == '3')) {
+    m_class = REQUEST_CGI;
+  }
+  return m_class;
+}
+
 /* 解析HTTP请求行，获取请求方法、目标URL、HTTP版本号 */
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
   m_url = strpbrk(text, " \t");
@@ -273,6 +361,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
   //当url为/时，显示默认页面
   if (strlen(m_url) == 1)
     strcat(m_url, "index.html");
+  /* 读缓冲扩容时内存会移动，只保存 URL 的偏移，在 do_request 中重新定位 */
+  m_url_idx = m_url - m_read_buf.peek();
   /* HTTP请求行处理完毕，状态转移到头部字段的分析 */
   m_check_state = CHECK_STATE_HEADER;
   return NO_REQUEST;
@@ -322,8 +412,11 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text) {
 
 /* 解析请求体，这里没有真正的去解析，仅判断是否被完整地读入 */
 http_conn::HTTP_CODE http_conn::parse_content(char *text) {
-  if (m_read_idx >= (m_content_length + m_checked_idx)) {
+  if ((int)m_read_buf.readable_bytes() >= (m_content_length + m_checked_idx)) {
+    /* 请求体之后可能紧跟着下一个请求，保存被结束符覆盖的字节 */
+    m_content_end = text[m_content_length];
     text[m_content_length] = '\0';
+    m_checked_idx += m_content_length;
     // POST请求中最后为输入的用户名和密码
     m_string = text;
     return GET_REQUEST;
@@ -369,8 +462,9 @@ http_conn::HTTP_CODE http_conn::process_read() {
       if (ret == GET_REQUEST) {
         return do_request();
       }
-      line_status = LINE_OPEN;
-      break;
+      /* 请求体还不完整，直接等待更多数据，不能再用 parse_line
+       * 扫描请求体，否则 m_checked_idx 会越过请求体的起始位置 */
+      return NO_REQUEST;
     }
     default:
       return INTERNAL_ERROR;
@@ -381,10 +475,11 @@ http_conn::HTTP_CODE http_conn::process_read() {
 }
 
 /* 当得到一个完整的、正确的HTTP请求时，我们就分析了目标文件的属性，如果目标文件存在，对所有用户可读，且不是目录，则使用mmap将其映射到内存地址
- * m_file_address 处，并告诉调用者获取文件成功 */
+ * m_file_address 处(大文件改用 sendfile)，并告诉调用者获取文件成功 */
 http_conn::HTTP_CODE http_conn::do_request() {
   strcpy(m_real_file, doc_root);
   int len = strlen(doc_root);
+  m_url = m_read_buf.peek() + m_url_idx;
 
   const char *p = strrchr(m_url, '/');
 
@@ -401,54 +496,69 @@ http_conn::HTTP_CODE http_conn::do_request() {
     free(m_url_real);
 
     //将用户名和密码提取出来
-    // user=123&passwd=123
-    char name[100], password[100];
-    int i;
-    for (i = 5; m_string[i] != '&'; ++i)
-      name[i - 5] = m_string[i];
-    name[i - 5] = '\0';
-
-    int j = 0;
-    for (i = i + 10; m_string[i] != '\0'; ++i, ++j)
-      password[j] = m_string[i];
-    password[j] = '\0';
+    char name[USER_LEN], password[USER_LEN];
+    parse_user(name, password, sizeof(name));
 
     //同步线程登录校验
     if (*(p + 1) == '3') {
       //如果是注册，先检测数据库中是否有重名的
       //没有重名的，进行增加数据
-      char *sql_insert = (char *)malloc(sizeof(char) * 200);
-      strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-      strcat(sql_insert, "'");
-      strcat(sql_insert, name);
-      strcat(sql_insert, "', '");
-      strcat(sql_insert, password);
-      strcat(sql_insert, "')");
-
-      if (users.find(name) == users.end()) {
-
-        m_lock.lock();
-        int res = mysql_query(mysql, sql_insert);
-        users.insert(pair<string, string>(name, password));
-        m_lock.unlock();
+      if (!user_table::get_instance()->contains(name)) {
+#ifdef USE_COROUTINE
+        /* 由 serve 挂起协程等待插入，完成后在 finish_register 中继续 */
+        return DB_REQUEST;
+#else
+        /* 预处理好的语句，用户名和密码作为参数发送，不拼接 SQL */
+        const char *args[] = {name, password};
+
+        /* 交给执行线程与其他线程的注册合并成一条多行 INSERT，
+         * 阻塞到这一批提交；工作线程不再自己占用数据库连接 */
+        int res = sql_executor::get_instance()->execute(STMT_INSERT_USER,
+                                                        args, 2);
+        /* 等待连接超时或数据库不可用，应答 503，用户可以重试 */
+        if (res == SQL_UNAVAILABLE) {
+          return SERVICE_UNAVAILABLE;
+        }
+        user_table::get_instance()->insert(name, password);
 
         if (!res)
           strcpy(m_url, "/log.html");
         else
           strcpy(m_url, "/registerError.html");
+#endif
       } else
         strcpy(m_url, "/registerError.html");
     }
     //如果是登录，直接判断
     //若浏览器端输入的用户名和密码在表中可以查找到，返回1，否则返回0
     else if (*(p + 1) == '2') {
-      if (users.find(name) != users.end() && users[name] == password)
+      if (user_table::get_instance()->check(name, password))
         strcpy(m_url, "/welcome.html");
       else
         strcpy(m_url, "/logError.html");
     }
   }
 
+  return do_file_request(p);
+}
+
+void http_conn::parse_user(char *name, char *password, int size) {
+  int length = strlen(m_string);
+  int i, j = 0;
+  for (i = 5; i < length && m_string[i] != '&'; ++i)
+    if (j < size - 1)
+      name[j++] = m_string[i];
+  name[j] = '\0';
+
+  j = 0;
+  for (i = i + 10; i < length; ++i)
+    if (j < size - 1)
+      password[j++] = m_string[i];
+  password[j] = '\0';
+}
+
+http_conn::HTTP_CODE http_conn::do_file_request(const char *p) {
+  int len = strlen(doc_root);
   if (*(p + 1) == '0') {
     char *m_url_real = (char *)malloc(sizeof(char) * 200);
     strcpy(m_url_real, "/register.html");
@@ -477,10 +587,13 @@ http_conn::HTTP_CODE http_conn::do_request() {
     strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
   }
 
-  if (stat(m_real_file, &m_file_stat) < 0) /* stat()函数获取文件信息 */
+  /* 文件信息、描述符和映射都从文件缓存中获取，命中时不再访问文件系统 */
+  m_file = file_cache::get_instance()->get(m_real_file);
+  if (m_file->err) /* stat()函数获取文件信息失败 */
   {
     return NO_RESOURCE;
   }
+  m_file_stat = m_file->st;
 
   if (!(m_file_stat.st_mode & S_IROTH)) {
     return FORBIDDEN_REQUEST;
@@ -490,19 +603,57 @@ http_conn::HTTP_CODE http_conn::do_request() {
     return BAD_REQUEST;
   }
 
-  int fd = open(m_real_file, O_RDONLY);
-  m_file_address =
-      (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  close(fd);
+  if (m_file->fd == -1) {
+    return INTERNAL_ERROR;
+  }
+  /* 小文件优先使用缓存的完整应答 */
+  m_response =
+      response_cache::get_instance()->get(m_real_file, m_file, get_content_type());
+  if (m_response) {
+    return FILE_REQUEST;
+  }
+  /* 大文件交给 sendfile 直接从页缓存发送，避免 mmap/munmap 带来的页表和TLB开销
+   * io_uring 后端由事件循环自行发送内存块，仍使用 mmap */
+  if (m_epollfd != -1 && m_sendfile_threshold >= 0 &&
+      m_file_stat.st_size >= m_sendfile_threshold) {
+    m_file_fd = m_file->fd;
+    return FILE_REQUEST;
+  }
+  m_file_address = m_file->map();
   return FILE_REQUEST;
 }
 
-/* 对内存映射区执行 munmap操作 */
+/* 释放对缓存文件的引用，映射和描述符在条目失效且无人使用后才真正释放 */
 void http_conn::unmap() {
-  if (m_file_address) {
-    munmap(m_file_address, m_file_stat.st_size);
-    m_file_address = 0;
+  m_file_address = 0;
+  m_file_fd = -1;
+  m_file.reset();
+  m_response.reset();
+  for (int i = 0; i < m_batch; ++i) {
+    m_batch_files[i].reset();
+    m_batch_responses[i].reset();
   }
+  m_batch = 0;
+}
+
+const char *http_conn::get_content_type() {
+  static const char *types[][2] = {
+      {".html", "text/html"},       {".htm", "text/html"},
+      {".css", "text/css"},         {".js", "application/javascript"},
+      {".jpg", "image/jpeg"},       {".jpeg", "image/jpeg"},
+      {".png", "image/png"},        {".gif", "image/gif"},
+      {".ico", "image/x-icon"},     {".mp4", "video/mp4"},
+      {".txt", "text/plain"},
+  };
+  const char *dot = strrchr(m_real_file, '.');
+  if (dot && !strchr(dot, '/')) {
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+      if (strcasecmp(dot, types[i][0]) == 0) {
+        return types[i][1];
+      }
+    }
+  }
+  return "application/octet-stream";
 }
 
 // /* 写HTTP 响应 */
@@ -557,12 +708,12 @@ bool http_conn::write() {
 
   if (bytes_to_send == 0) {
     modfd(m_epollfd, m_sockfd, EPOLLIN);
-    init();
+    init_write();
     return true;
   }
 
   while (1) {
-    temp = writev(m_sockfd, m_iv, m_iv_count);
+    temp = send_once();
     if (temp <= -1) {
       /* 如果TCP
        * 写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间
@@ -575,54 +726,114 @@ bool http_conn::write() {
       unmap();
       return false;
     }
-
-    bytes_to_send -= temp;
-    bytes_have_send += temp;
-
-    if (bytes_have_send >= m_iv[0].iov_len) {
-      m_iv[0].iov_len = 0;
-      m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-      m_iv[1].iov_len = bytes_to_send;
-    } else {
-      m_iv[0].iov_base = m_write_buf + bytes_have_send;
-      m_iv[0].iov_len = m_iv[0].iov_len - bytes_have_send;
+    if (temp == 0) {
+      /* 还有数据却一个字节也没发出：文件在获取长度之后被截断，sendfile 读到文件末尾，
+       * 应答已经无法按 Content-Length 发完，关闭连接 */
+      unmap();
+      return false;
     }
 
     /* 发送HTTP响应成功
      * 根据HTTP请求中的 Contention 字段决定是否理解关闭连接
      */
-    if (bytes_to_send <= 0) {
-      unmap();
-      modfd(m_epollfd, m_sockfd, EPOLLIN);
-
-      if (m_linger) {
-        init();
-        return true;
-      } else {
+    if (advance_write(temp)) {
+      if (!finish_write()) {
         return false;
       }
+      /* 还有已收到的请求时由事件循环直接交给线程池，不再等待可读 */
+      if (!m_pending) {
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
+      }
+      return true;
     }
   }
 }
 
-/* 往写缓冲中写入待发送的数据 */
-bool http_conn::add_response(const char *format, ...) {
-  if (m_write_idx >= WRITE_BUFFER_SIZE) {
+int http_conn::send_once() {
+  if (m_file_fd == -1) {
+    return writev(m_sockfd, m_iv, m_iv_count);
+  }
+  /* 内存中的部分(之前合并的应答和最后一个应答的应答头)带 MSG_MORE 发送，
+   * 与随后 sendfile 的文件内容合并成满长度的报文段 */
+  if (bytes_to_send > m_file_stat.st_size) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = m_iv;
+    msg.msg_iovlen = m_iv_count;
+    return sendmsg(m_sockfd, &msg, MSG_MORE);
+  }
+  off_t offset = m_file_stat.st_size - bytes_to_send;
+  return sendfile(m_sockfd, m_file_fd, &offset, bytes_to_send);
+}
+
+bool http_conn::append_read(const char *data, int len) {
+  if (m_read_buf.readable_bytes() + len > READ_BUFFER_LIMIT) {
     return false;
   }
+  m_read_buf.append(data, len);
+  m_read_buf.ensure_writable(1);
+  return true;
+}
+
+struct iovec *http_conn::get_iov(int *count) {
+  *count = m_iv_count;
+  return m_iv;
+}
+
+bool http_conn::advance_write(int bytes) {
+  bytes_to_send -= bytes;
+  bytes_have_send += bytes;
+
+  /* 依次跳过已发送的内存块，内存块可能来自写缓冲、文件映射或应答缓存
+   * sendfile 模式下 m_iv 只有应答头，超出部分为文件内容 */
+  for (int i = 0; i < m_iv_count && bytes > 0; ++i) {
+    if ((size_t)bytes >= m_iv[i].iov_len) {
+      bytes -= m_iv[i].iov_len;
+      m_iv[i].iov_len = 0;
+    } else {
+      m_iv[i].iov_base = (char *)m_iv[i].iov_base + bytes;
+      m_iv[i].iov_len -= bytes;
+      bytes = 0;
+    }
+  }
+  return bytes_to_send <= 0;
+}
+
+bool http_conn::finish_write() {
+  unmap();
+  init_write();
+  return m_keep_alive;
+}
+
+/* 往写缓冲中写入待发送的数据 */
+void http_conn::add_iov(char *base, int len) {
+  bytes_to_send += len;
+  /* 与上一块在写缓冲中相邻时直接合并 */
+  if (m_iv_count > 0) {
+    struct iovec &last = m_iv[m_iv_count - 1];
+    if ((char *)last.iov_base + last.iov_len == base) {
+      last.iov_len += len;
+      return;
+    }
+  }
+  m_iv[m_iv_count].iov_base = base;
+  m_iv[m_iv_count].iov_len = len;
+  ++m_iv_count;
+}
+
+bool http_conn::add_response(const char *format, ...) {
   /* VA_LIST 是C语言的宏解决可变参数的问题 */
   va_list arg_list;
   va_start(arg_list, format);
-  /* vsnprintf()用于向一个字符串缓冲区打印格式化字符串，且可以限定打印的格式化字符串的最大长度。
-   */
-  int len = vsnprintf(m_write_buf + m_write_idx,
-                      WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-  if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx)) {
+  /* 写缓冲由多个块串成，已写入的内容不会移动，可以直接作为待发送的内存块 */
+  int len = 0;
+  char *data = m_write_buf.append_format(&len, format, arg_list);
+  va_end(arg_list);
+  if (!data) {
     return false;
   }
-  m_write_idx += len;
-  va_end(arg_list);
-  LOG_INFO("request:%s", m_write_buf);
+  add_iov(data, len);
+  LOG_INFO("request:%.*s", len, data);
   Log::get_instance()->flush();
   return true;
 }
@@ -631,18 +842,22 @@ bool http_conn::add_status_line(int status, const char *title) {
   return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool http_conn::add_headers(int content_len) {
-  add_content_length(content_len);
-  add_linger();
-  add_blank_line();
+bool http_conn::add_headers(int content_len, const char *content_type) {
+  if (!add_content_length(content_len)) {
+    return false;
+  }
+  if (content_type && !add_content_type(content_type)) {
+    return false;
+  }
+  return add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_len) {
   return add_response("Content-Length: %d\r\n", content_len);
 }
 
-bool http_conn::add_content_type() {
-  return add_response("Content-Type:%s\r\n", "text/html");
+bool http_conn::add_content_type(const char *content_type) {
+  return add_response("Content-Type:%s\r\n", content_type);
 }
 bool http_conn::add_linger() {
   return add_response("Connection:%s\r\n",
@@ -655,6 +870,7 @@ bool http_conn::add_content(const char *content) {
   return add_response("%s", content);
 }
 
+/* 把应答追加到待发送的内存块中，之前合并的应答保持不变 */
 bool http_conn::process_write(HTTP_CODE ret) {
   switch (ret) {
   case INTERNAL_ERROR: {
@@ -665,6 +881,14 @@ bool http_conn::process_write(HTTP_CODE ret) {
     }
     break;
   }
+  case SERVICE_UNAVAILABLE: {
+    add_status_line(503, error_503_title);
+    add_headers(strlen(error_503_form));
+    if (!add_content(error_503_form)) {
+      return false;
+    }
+    break;
+  }
   case BAD_REQUEST: {
     add_status_line(400, error_400_title);
     add_headers(strlen(error_400_form));
@@ -690,16 +914,25 @@ bool http_conn::process_write(HTTP_CODE ret) {
     break;
   }
   case FILE_REQUEST: {
+    if (m_response) {
+      /* 命中应答缓存，应答头和文件内容都是共享的只读内存，不再格式化 */
+      const string &header = m_response->header[m_linger];
+      add_iov((char *)header.data(), header.size());
+      add_iov((char *)m_response->body.data(), m_response->body.size());
+      break;
+    }
     add_status_line(200, ok_200_title);
-    if (m_file_stat.st_size != 0) {
-      add_headers(m_file_stat.st_size);
-      m_iv[0].iov_base = m_write_buf;
-      m_iv[0].iov_len = m_write_idx;
-      m_iv[1].iov_base = m_file_address;
-      m_iv[1].iov_len = m_file_stat.st_size;
-      m_iv_count = 2;
-      bytes_to_send = m_write_idx + m_file_stat.st_size;
-      return true;
+    if (m_file_stat.st_size != 0 && m_file_fd != -1) {
+      /* 文件内容由 sendfile 发送，m_iv 中只有应答头 */
+      if (!add_headers(m_file_stat.st_size, get_content_type())) {
+        return false;
+      }
+      bytes_to_send += m_file_stat.st_size;
+    } else if (m_file_stat.st_size != 0) {
+      if (!add_headers(m_file_stat.st_size, get_content_type())) {
+        return false;
+      }
+      add_iov(m_file_address, m_file_stat.st_size);
     } else {
       const char *ok_string = "<html><body></body></html>";
       add_headers(strlen(ok_string));
@@ -707,36 +940,137 @@ bool http_conn::process_write(HTTP_CODE ret) {
         return false;
       }
     }
+    break;
   }
   default: {
     return false;
   }
   }
 
-  m_iv[0].iov_base = m_write_buf;
-  m_iv[0].iov_len = m_write_idx;
-  m_iv_count = 1;
-  bytes_to_send = m_write_idx;
+  /* 文件缓存条目和缓存应答要保留到整批应答发送完毕 */
+  m_batch_files[m_batch].swap(m_file);
+  m_batch_responses[m_batch].swap(m_response);
+  ++m_batch;
   return true;
 }
 
+bool http_conn::batch_has_room() const {
+  /* sendfile 发送的应答只能是最后一个 */
+  return m_batch < PIPELINE_DEPTH && m_file_fd == -1;
+}
+
 /* 由线程池中的工作线程调用，这是处理 HTTP 请求的入口函数 */
 void http_conn::process() {
-  HTTP_CODE read_ret = process_read();
-  if (read_ret == NO_REQUEST) {
-    /* EPOLLIN事件则只有当对端有数据写入时才会触发
-     * 所以触发一次后需要不断读取所有数据直到读完EAGAIN为止
-     * 否则剩下的数据只有在下次对端有写入时才能一起取出来了。
-     */
-    modfd(m_epollfd, m_sockfd, EPOLLIN);
+#ifdef USE_COROUTINE
+  /* 等待的数据库操作已经完成，从挂起处继续处理 */
+  if (m_coro) {
+    std::coroutine_handle<> coro = m_coro;
+    m_coro = nullptr;
+    coro.resume();
     return;
   }
+#endif
+  serve();
+}
+
+#ifdef USE_COROUTINE
+co_task http_conn::serve() {
+#else
+void http_conn::serve() {
+#endif
+  m_pending = false;
+  /* 处理完后交还给事件循环的命令，0 表示关闭连接。请求不完整时继续读：
+   * EPOLLIN事件则只有当对端有数据写入时才会触发
+   * 所以触发一次后需要不断读取所有数据直到读完EAGAIN为止
+   * 否则剩下的数据只有在下次对端有写入时才能一起取出来了。
+   */
+  int ev = EPOLLIN;
+  HTTP_CODE read_ret = process_read();
+
+  /* 客户端流水线发送的后续请求已经在读缓冲中时一并处理，
+   * 多个应答合并到一次 writev 中发送 */
+  while (read_ret != NO_REQUEST) {
+    /* EPOLLOUT事件只有在不可写到可写的转变时刻，才会触发一次 */
+    ev = EPOLLOUT;
+#ifdef USE_COROUTINE
+    if (read_ret == DB_REQUEST) {
+      /* 挂起等待插入完成，期间工作线程去处理其他请求 */
+      sql_awaiter insert(this);
+      int res = co_await insert;
+      read_ret = finish_register(insert.m_name, insert.m_password, res);
+    }
+#endif
+    bool write_ret = process_write(read_ret);
+    if (!write_ret) {
+      ev = 0;
+      break;
+    }
+    m_keep_alive = m_linger;
+    if (!m_keep_alive) {
+      break;
+    }
+    init_request();
+    if (!batch_has_room()) {
+      m_pending = m_read_buf.readable_bytes() > 0;
+      break;
+    }
+    read_ret = process_read();
+  }
 
-  bool write_ret = process_write(read_ret);
-  if (!write_ret) {
+  if (ev == 0) {
     close_conn();
+  } else {
+    rearm(ev);
+  }
+}
+
+#ifdef USE_COROUTINE
+http_conn::HTTP_CODE http_conn::finish_register(const char *name,
+                                                const char *password, int res) {
+  if (res == SQL_UNAVAILABLE) {
+    return SERVICE_UNAVAILABLE;
+  }
+  user_table::get_instance()->insert(name, password);
+
+  m_url = m_read_buf.peek() + m_url_idx;
+  const char *p = strrchr(m_url, '/');
+  if (!res)
+    strcpy(m_url, "/log.html");
+  else
+    strcpy(m_url, "/registerError.html");
+  return do_file_request(p);
+}
+
+http_conn::sql_awaiter::sql_awaiter(http_conn *conn) : m_conn(conn) {
+  conn->parse_user(m_name, m_password, USER_LEN);
+  stmt = STMT_INSERT_USER;
+  args[0] = m_name;
+  args[1] = m_password;
+  arg_number = 2;
+  single = false;
+  result = 1;
+  done = on_done;
+  next = NULL;
+}
+
+void http_conn::sql_awaiter::await_suspend(std::coroutine_handle<> coro) {
+  /* 提交之后请求可能立即完成并在其他线程恢复，提交是最后一步 */
+  m_conn->m_coro = coro;
+  if (!m_conn->m_owner->submit_sql(this)) {
+    sql_executor::get_instance()->submit(this);
   }
+}
 
-  /* EPOLLOUT事件只有在不可写到可写的转变时刻，才会触发一次 */
-  modfd(m_epollfd, m_sockfd, EPOLLOUT);
+void http_conn::sql_awaiter::on_done(sql_request *req) {
+  http_conn *conn = static_cast<sql_awaiter *>(req)->m_conn;
+  conn->m_owner->reschedule(conn);
+}
+#endif
+
+void http_conn::rearm(int ev) {
+  if (m_owner) {
+    m_owner->rearm(this, ev);
+    return;
+  }
+  modfd(m_epollfd, m_sockfd, ev);
 }
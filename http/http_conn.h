@@ -2,10 +2,15 @@
 #define HTTPCONNECTION_H
 
 #include "../CGImysql/sql_connection_pool.h"
+#include "../CGImysql/sql_executor.h"
+#include "../buffer/buffer.h"
+#include "../cache/file_cache.h"
+#include "../cache/response_cache.h"
 #include "../lock/locker.h"
 #include "../log/log.h"
 #include <arpa/inet.h>
 #include <assert.h>
+#include <atomic>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
@@ -17,21 +22,61 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef USE_COROUTINE
+#include "../coroutine/co_task.h"
+#include <coroutine>
+#endif
+
+/* 网站根目录 */
+extern const char *doc_root;
+
+class http_conn;
+struct sql_request;
+
+/* 连接所属的事件循环，epoll 以外的I/O后端(如 io_uring)实现该接口，
+ * 工作线程处理完请求后通过它把结果交还给事件循环线程 */
+class conn_owner {
+
+public:
+  virtual ~conn_owner() {}
+  /* 请求处理完毕，ev 为 EPOLLIN 表示继续读取请求，EPOLLOUT 表示发送应答 */
+  virtual void rearm(http_conn *conn, int ev) = 0;
+  /* 工作线程要求关闭连接 */
+  virtual void close(http_conn *conn) = 0;
+  /* 请求在等待数据库等操作时挂起，操作完成后由任意线程调用，把连接重新交给线程池 */
+  virtual void reschedule(http_conn *conn) = 0;
+  /* 由事件循环用非阻塞连接执行语句，完成后调用 req->done，不支持时返回 false */
+  virtual bool submit_sql(sql_request * /*req*/) { return false; }
+};
+
 class http_conn {
 
 public:
   /* 文件名最大长度 */
   static const int FILENAME_LEN = 200;
-  /* 读缓冲大小 */
+  /* 读缓冲初始大小，不够时自动扩容 */
   static const int READ_BUFFER_SIZE = 2048;
-  /* 写缓冲大小 */
+  /* 一个请求(请求行、头部和请求体)的最大长度 */
+  static const int READ_BUFFER_LIMIT = 1024 * 1024;
+  /* 写缓冲每个块的大小 */
   static const int WRITE_BUFFER_SIZE = 1024;
+  /* 默认不小于该大小的文件使用 sendfile 发送 */
+  static const int SENDFILE_THRESHOLD = 64 * 1024;
+  /* 默认不大于该大小的文件缓存完整应答 */
+  static const int RESPONSE_CACHE_FILE_SIZE = 32 * 1024;
+  /* 用户名和密码的最大长度(含结束符) */
+  static const int USER_LEN = 100;
+  /* 默认应答缓存的内存预算 */
+  static const int RESPONSE_CACHE_BUDGET = 64 * 1024 * 1024;
+  /* 一次 writev 最多合并的流水线(pipelining)应答数 */
+  static const int PIPELINE_DEPTH = 8;
 
   /* HTTP请求方法，目前仅支持GET */
   enum METHOD {
@@ -62,19 +107,37 @@ public:
     FORBIDDEN_REQUEST, /* 客户对资源没有足够的访问权限 */
     FILE_REQUEST,      /* 请求文件 */
     INTERNAL_ERROR,
-    CLOSED_CONNECTION
+    CLOSED_CONNECTION,
+    SERVICE_UNAVAILABLE, /* 数据库暂时不可用 */
+    DB_REQUEST /* 需要等待数据库，只在以 USE_COROUTINE 编译时返回 */
+  };
+
+  /* 请求的类别，线程池按类别分别排队，数值越小优先级越高 */
+  enum REQUEST_CLASS {
+    REQUEST_STATIC = 0, /* 静态文件 */
+    REQUEST_CGI,        /* 登录和注册，可能访问数据库 */
+    REQUEST_CLASS_NUMBER
   };
 
   /* 行读取状态 */
   enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
 public:
-  http_conn(){};
+  http_conn()
+      : m_command(0), m_next_command(NULL), m_read_buf(READ_BUFFER_SIZE),
+        m_write_buf(WRITE_BUFFER_SIZE), m_file_address(NULL), m_file_fd(-1),
+        m_batch(0) {
+#ifdef USE_COROUTINE
+    m_coro = nullptr;
+#endif
+  };
   ~http_conn(){};
 
 public:
-  /* 初始化新的连接 */
-  void init(int sockfd, const sockaddr_in &addr);
+  /* 初始化新的连接，epollfd 为接受该连接的事件循环的内核事件表，
+   * 非epoll后端传入 -1，owner 为连接所属的事件循环 */
+  void init(int sockfd, const sockaddr_in &addr, int epollfd,
+            conn_owner *owner = NULL);
   /* 关闭连接 */
   void close_conn(bool real_close = true);
   /* 处理客户请求 */
@@ -84,70 +147,143 @@ public:
   /* 非阻塞写 */
   bool write();
   sockaddr_in *get_address() { return &m_address; }
-  void initmysql_result(connection_pool *connPool);
+  int get_sockfd() const { return m_sockfd; }
+  static void initmysql_result(connection_pool *connPool);
+
+  /* 下面这一组函数供异步I/O后端驱动同一个状态机，由后端自己完成收发 */
+  /* 追加已接收的数据，读缓冲满时返回false */
+  bool append_read(const char *data, int len);
+  /* 获取待发送的内存块 */
+  struct iovec *get_iov(int *count);
+  /* 已发送 bytes 字节，更新待发送内存块，全部发送完毕时返回 true */
+  bool advance_write(int bytes);
+  /* 应答发送完毕，释放文件映射，返回是否保持连接 */
+  bool finish_write();
+  /* 连接关闭后归还读写缓冲并释放文件引用 */
+  void release_buffers();
+  /* 请求头已解析完，正在接收请求体 */
+  bool reading_body() const { return m_check_state == CHECK_STATE_CONTENT; }
+  /* 应答尚未发送完 */
+  bool is_writing() const { return bytes_to_send > 0; }
+  /* 应答已全部发送且读缓冲中还有未处理的请求，应直接交给线程池而不是等待可读 */
+  bool has_pending_request() const { return m_pending && bytes_to_send == 0; }
+  /* 根据读缓冲中的请求行判断下一个要处理的请求的类别，由事件循环线程在交给线程池之前调用 */
+  REQUEST_CLASS classify();
 
 private:
   /* 初始化连接 */
   void init();
+  /* 丢弃读缓冲中已处理的请求，保留之后收到的数据，并重置解析状态 */
+  void init_request();
+  /* 清空已发送完的应答 */
+  void init_write();
+  /* 是否还能把下一个请求的应答合并到本次发送中 */
+  bool batch_has_room() const;
+  /* 处理读缓冲中的请求并填充应答，以 USE_COROUTINE 编译时在协程中执行，
+   * 等待数据库时挂起，不占用工作线程 */
+#ifdef USE_COROUTINE
+  co_task serve();
+#else
+  void serve();
+#endif
   /* 解析HTTP 请求 */
   HTTP_CODE process_read();
   /* 填充HTTP应答 */
   bool process_write(HTTP_CODE ret);
+  /* 重新注册 EPOLLONESHOT 事件，或通知 owner */
+  void rearm(int ev);
 
   /* 下面这一组函数被 process_read 调用以分析HTTP请求 */
   HTTP_CODE parse_request_line(char *text);
   HTTP_CODE parse_headers(char *text);
   HTTP_CODE parse_content(char *text);
   HTTP_CODE do_request();
-  char *get_line() { return m_read_buf + m_start_line; }
+  /* 根据 URL 确定目标文件并从文件缓存中获取，p 指向 URL 的最后一个'/' */
+  HTTP_CODE do_file_request(const char *p);
+  /* 从请求体 user=123&passwd=123 中取出用户名和密码，超出数组的部分截断 */
+  void parse_user(char *name, char *password, int size);
+#ifdef USE_COROUTINE
+  /* 注册请求的插入语句执行完毕，res 为0表示成功，继续处理该请求 */
+  HTTP_CODE finish_register(const char *name, const char *password, int res);
+
+  /* co_await 该对象时把插入新用户的预处理语句交给所属事件循环的非阻塞连接
+   * (不可用时交给 sql_executor)执行并挂起协程，
+   * 执行完毕后通过所属事件循环重新交给线程池，恢复后得到执行结果，0表示成功 */
+  struct sql_awaiter : public sql_request {
+    explicit sql_awaiter(http_conn *conn);
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> coro);
+    int await_resume() const { return result; }
+    static void on_done(sql_request *req);
+
+    http_conn *m_conn;
+    /* 语句的参数，挂起期间保存在协程帧中 */
+    char m_name[USER_LEN];
+    char m_password[USER_LEN];
+  };
+#endif
+  char *get_line() { return m_read_buf.peek() + m_start_line; }
   LINE_STATUS parse_line();
 
+  /* 用 writev 或 sendmsg + sendfile 发送一次，返回发送的字节数 */
+  int send_once();
+
   /* 下面这一组函数被 process_write 调用填充 HTTP 应答 */
   void unmap();
+  /* 追加一个待发送的内存块 */
+  void add_iov(char *base, int len);
   bool add_response(const char *format, ...);
   bool add_content(const char *content);
   bool add_status_line(int status, const char *title);
-  bool add_headers(int content_length);
-  bool add_content_type();
+  bool add_headers(int content_length, const char *content_type = NULL);
+  bool add_content_type(const char *content_type);
+  /* 根据目标文件的扩展名得到 Content-Type */
+  const char *get_content_type();
   bool add_content_length(int content_length);
   bool add_linger();
   bool add_blank_line();
 
 public:
-  /* 所有socket上的事件都被注册到一个epoll内核事件表中，因此需要设置 static */
-  static int m_epollfd;
-  /* 统计数量 */
-  static int m_user_count;
-  MYSQL *mysql;
+  /* 工作线程交还给事件循环的命令，以及在事件循环邮箱中排队时的链接指针 */
+  int m_command;
+  http_conn *m_next_command;
+  /* 统计数量，多个事件循环线程同时修改 */
+  static std::atomic<int> m_user_count;
+  /* 不小于该大小的文件用 sendfile 零拷贝发送，小于0表示始终使用 mmap */
+  static int m_sendfile_threshold;
 
 private:
+  /* 该连接所属事件循环的epoll内核事件表 */
+  int m_epollfd;
+  /* 非epoll后端下该连接所属的事件循环 */
+  conn_owner *m_owner;
   /* 该HTTP连接的socket和对方的socket地址 */
   int m_sockfd;
   sockaddr_in m_address;
 
-  /* 读缓冲 */
-  char m_read_buf[READ_BUFFER_SIZE];
-  /* 表示读缓冲中已经读入的客户数据的最后一个字节的下一个位置 */
-  int m_read_idx;
-  /* 当前正在分析的字符在读缓冲中的位置 */
+  /* 读缓冲，每次读入后至少留有一个字节的空闲，用于在请求体末尾写入结束符 */
+  buffer m_read_buf;
+  /* 当前正在分析的字符相对可读数据起始位置的偏移 */
   int m_checked_idx;
   /* 当前正在解析的行起始位置 */
   int m_start_line;
-  /* 写缓冲 */
-  char m_write_buf[WRITE_BUFFER_SIZE];
-  /* 写缓冲区中待发送的字节数 */
-  int m_write_idx;
+  /* 写缓冲，存放应答头和错误页面 */
+  chain_buffer m_write_buf;
 
   /* 主状态机当前所处的状态 */
   CHECK_STATE m_check_state;
   /* 请求方法 */
   METHOD m_method;
+  /* 当前请求的类别，请求行解析之后不再改变 */
+  REQUEST_CLASS m_class;
 
   /* 客户请求目标文件的完整路径，内容等于doc_root + m_url
    * ，doc_root表示网址根目录 */
   char m_real_file[FILENAME_LEN];
   /* 客户请求目标文件的文件名 */
   char *m_url;
+  /* m_url 在读缓冲中的偏移 */
+  int m_url_idx;
   /* HTTP版本号 */
   char *m_version;
   /* 主机名 */
@@ -156,9 +292,21 @@ private:
   int m_content_length;
   /* HTTP请求是否保持连接 */
   bool m_linger;
+  /* 请求体末尾被结束符覆盖的字节，可能属于下一个流水线请求 */
+  char m_content_end;
+  /* 本次发送的最后一个应答是否保持连接 */
+  bool m_keep_alive;
+  /* 因本次发送已满而尚未处理的后续请求 */
+  bool m_pending;
 
+  /* 客户请求的目标文件在文件缓存中的条目，发送完毕前保证映射和描述符有效 */
+  file_ref m_file;
   /* 客户请求的目标文件被mmap到内存中启示位置 */
   char *m_file_address;
+  /* 使用 sendfile 发送时目标文件的描述符(属于文件缓存)，否则为 -1 */
+  int m_file_fd;
+  /* 命中应答缓存时的完整应答，应答头和文件内容直接从缓存发送 */
+  response_ref m_response;
   /* 目标文件状态，用于判断文件
    * 是否存在，是否为根目录，是否可读，并获取文件大小等信息
    */
@@ -166,8 +314,18 @@ private:
   /* 采用write来执行写操作，所以定义下面两个成员
    * 其中 m_iv_count 表示被写入内存块的数量
    */
-  struct iovec m_iv[2];
+  /* 每个应答最多三块：跨越两个写缓冲块的应答头和文件内容 */
+  struct iovec m_iv[3 * PIPELINE_DEPTH];
   int m_iv_count;
+  /* 本次发送中各个应答引用的文件缓存条目和缓存应答，发送完毕后释放 */
+  file_ref m_batch_files[PIPELINE_DEPTH];
+  response_ref m_batch_responses[PIPELINE_DEPTH];
+  int m_batch;
+
+#ifdef USE_COROUTINE
+  /* 挂起等待数据库的协程，为空表示没有挂起的请求 */
+  std::coroutine_handle<> m_coro;
+#endif
 
   int cgi;        // 是否启用的POST
   char *m_string; //存储请求头数据
@@ -0,0 +1,158 @@
+#include "user_table.h"
+#include <string.h>
+#include <vector>
+
+user_table::user_table() {
+  for (int i = 0; i < SHARD_NUMBER; ++i) {
+    m_shards[i].current.store(new_table(INITIAL_SIZE, NULL),
+                              std::memory_order_relaxed);
+    m_shards[i].count.store(0, std::memory_order_relaxed);
+  }
+}
+
+user_table::~user_table() {
+  for (int i = 0; i < SHARD_NUMBER; ++i) {
+    table *t = m_shards[i].current.load(std::memory_order_relaxed);
+    /* 条目只属于最新的数组，旧数组中的指针是它的子集 */
+    for (size_t j = 0; j <= t->mask; ++j) {
+      delete t->slots[j].load(std::memory_order_relaxed);
+    }
+    while (t) {
+      table *prev = t->prev;
+      delete[] t->slots;
+      delete t;
+      t = prev;
+    }
+  }
+}
+
+/* FNV-1a，低位选分片，其余位在分片内寻址 */
+size_t user_table::hash(const char *name) {
+  size_t h = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+    h ^= *p;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+user_table::table *user_table::new_table(size_t size, table *prev) {
+  table *t = new table;
+  t->mask = size - 1;
+  t->slots = new std::atomic<entry *>[size];
+  for (size_t i = 0; i < size; ++i) {
+    t->slots[i].store(NULL, std::memory_order_relaxed);
+  }
+  t->prev = prev;
+  return t;
+}
+
+const user_table::entry *user_table::lookup(const char *name) const {
+  size_t h = hash(name);
+  const shard *s = &m_shards[h & (SHARD_NUMBER - 1)];
+  /* 读到新数组时，复制到其中的槽和条目的内容都已可见 */
+  const table *t = s->current.load(std::memory_order_acquire);
+  for (size_t i = h >> SHARD_BITS;; ++i) {
+    const entry *e = t->slots[i & t->mask].load(std::memory_order_acquire);
+    if (!e) {
+      return NULL;
+    }
+    if (e->hash == h && e->name == name) {
+      return e;
+    }
+  }
+}
+
+bool user_table::check(const char *name, const char *password) const {
+  const entry *e = lookup(name);
+  return e && e->password == password;
+}
+
+bool user_table::insert_locked(shard *s, size_t h, const char *name,
+                               const char *password) {
+  table *t = s->current.load(std::memory_order_relaxed);
+  size_t i = h >> SHARD_BITS;
+  for (;; ++i) {
+    entry *e = t->slots[i & t->mask].load(std::memory_order_relaxed);
+    if (!e) {
+      break;
+    }
+    if (e->hash == h && e->name == name) {
+      return false;
+    }
+  }
+
+  entry *e = new entry;
+  e->hash = h;
+  e->name = name;
+  e->password = password;
+
+  size_t count = s->count.load(std::memory_order_relaxed);
+  if ((count + 1) * 2 > t->mask + 1) {
+    /* 在新数组中放好所有条目之后才发布，读者看到的总是完整的一代 */
+    table *grown = new_table((t->mask + 1) * 2, t);
+    for (size_t j = 0; j <= t->mask; ++j) {
+      entry *old = t->slots[j].load(std::memory_order_relaxed);
+      if (old) {
+        size_t k = old->hash >> SHARD_BITS;
+        while (grown->slots[k & grown->mask].load(std::memory_order_relaxed)) {
+          ++k;
+        }
+        grown->slots[k & grown->mask].store(old, std::memory_order_relaxed);
+      }
+    }
+    for (i = h >> SHARD_BITS;
+         grown->slots[i & grown->mask].load(std::memory_order_relaxed); ++i) {
+    }
+    grown->slots[i & grown->mask].store(e, std::memory_order_relaxed);
+    s->current.store(grown, std::memory_order_release);
+  } else {
+    t->slots[i & t->mask].store(e, std::memory_order_release);
+  }
+  s->count.store(count + 1, std::memory_order_relaxed);
+  return true;
+}
+
+bool user_table::insert(const char *name, const char *password) {
+  size_t h = hash(name);
+  shard *s = &m_shards[h & (SHARD_NUMBER - 1)];
+  s->lock.lock();
+  bool ret = insert_locked(s, h, name, password);
+  s->lock.unlock();
+  return ret;
+}
+
+int user_table::insert_batch(const char *const *names,
+                             const char *const *passwords, int n) {
+  std::vector<size_t> hashes(n);
+  int shard_used = 0;
+  for (int i = 0; i < n; ++i) {
+    hashes[i] = hash(names[i]);
+    shard_used |= 1 << (hashes[i] & (SHARD_NUMBER - 1));
+  }
+
+  int inserted = 0;
+  for (int k = 0; k < SHARD_NUMBER; ++k) {
+    if (!(shard_used & (1 << k))) {
+      continue;
+    }
+    shard *s = &m_shards[k];
+    s->lock.lock();
+    for (int i = 0; i < n; ++i) {
+      if ((int)(hashes[i] & (SHARD_NUMBER - 1)) == k &&
+          insert_locked(s, hashes[i], names[i], passwords[i])) {
+        ++inserted;
+      }
+    }
+    s->lock.unlock();
+  }
+  return inserted;
+}
+
+size_t user_table::size() const {
+  size_t n = 0;
+  for (int i = 0; i < SHARD_NUMBER; ++i) {
+    n += m_shards[i].count.load(std::memory_order_relaxed);
+  }
+  return n;
+}
@@ -0,0 +1,78 @@
+#ifndef USER_TABLE_H
+#define USER_TABLE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <string>
+
+#include "../lock/locker.h"
+
+using namespace std;
+
+/* 用户名到密码的并发哈希表，登录时查找，注册时插入
+ * 按用户名哈希分片，每片是一个开放寻址的指针数组，槽一旦写入便不再修改，
+ * 查找不加锁，只做 acquire 读；插入时持有分片的锁，写好条目再发布到槽中。
+ * 装载因子超过一半时把指针复制到两倍大的新数组再发布，旧数组不释放：
+ * 不加锁的查找可能还在读它，各代数组的总大小不超过最新数组的两倍。
+ * 用户不会被删除，密码也不会修改，条目和数组在析构时统一释放。
+ */
+class user_table {
+
+public:
+  static user_table *get_instance() {
+    static user_table instance;
+    return &instance;
+  }
+
+  /* 用户是否存在 */
+  bool contains(const char *name) const { return lookup(name) != NULL; }
+  /* 用户存在并且密码一致 */
+  bool check(const char *name, const char *password) const;
+  /* 插入新用户，已存在时不修改并返回 false */
+  bool insert(const char *name, const char *password);
+  /* 插入 n 个用户，每个分片只加一次锁，返回新插入的个数 */
+  int insert_batch(const char *const *names, const char *const *passwords,
+                   int n);
+  /* 用户数，并发插入时只是一个估计 */
+  size_t size() const;
+
+private:
+  user_table();
+  ~user_table();
+
+  struct entry {
+    size_t hash;
+    string name;
+    string password;
+  };
+
+  struct table {
+    size_t mask;
+    std::atomic<entry *> *slots;
+    table *prev; /* 上一代数组，析构时释放 */
+  };
+
+  struct shard {
+    locker lock;
+    std::atomic<table *> current;
+    std::atomic<size_t> count; /* 持有锁时修改 */
+    char pad[64];
+  };
+
+  static size_t hash(const char *name);
+  static table *new_table(size_t size, table *prev);
+  const entry *lookup(const char *name) const;
+  /* 调用时持有分片的锁 */
+  bool insert_locked(shard *s, size_t h, const char *name,
+                     const char *password);
+
+private:
+  static const int SHARD_BITS = 4;
+  static const int SHARD_NUMBER = 1 << SHARD_BITS;
+  /* 每片数组的初始大小，必须是2的幂 */
+  static const size_t INITIAL_SIZE = 64;
+
+  shard m_shards[SHARD_NUMBER];
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/* 有界的多生产者多消费者无锁环形队列
+ * 每个槽带一个序号：序号等于入队位置时可写，等于入队位置+1时可读，
+ * 生产者和消费者各自用 CAS 抢占位置，抢到之后只写自己的槽，不需要锁，
+ * 也不为元素申请内存。容量向上取整为2的幂，队列满时 push 返回 false。
+ * 每个元素可以附带一个时间戳(如入队时间)，用于统计排队时间。
+ */
+template <typename T> class mpmc_queue {
+
+public:
+  explicit mpmc_queue(size_t capacity) : m_enqueue_pos(0), m_dequeue_pos(0) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    m_mask = size - 1;
+    m_cells = new cell[size];
+    for (size_t i = 0; i < size; ++i) {
+      m_cells[i].seq.store(i, std::memory_order_relaxed);
+      m_cells[i].data = NULL;
+      m_cells[i].stamp.store(0, std::memory_order_relaxed);
+    }
+  }
+  ~mpmc_queue() { delete[] m_cells; }
+
+  /* 由任意线程调用，队列满时返回 false */
+  bool push(T *data, int64_t stamp = 0) {
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &m_cells[pos & m_mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        /* 槽中的元素还没有被取走，队列已满 */
+        return false;
+      } else {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    c->data = data;
+    c->stamp.store(stamp, std::memory_order_relaxed);
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* 由任意线程调用，队列为空时返回 NULL，stamp 不为空时返回元素的时间戳 */
+  T *pop(int64_t *stamp = NULL) {
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &m_cells[pos & m_mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return NULL;
+      } else {
+        pos = m_dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    T *data = c->data;
+    if (stamp) {
+      *stamp = c->stamp.load(std::memory_order_relaxed);
+    }
+    /* 槽在下一圈可以再次写入 */
+    c->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return data;
+  }
+
+  /* 队首元素的时间戳，队列为空时返回0，并发修改时只是一个估计 */
+  int64_t front_stamp() const {
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    const cell *c = &m_cells[pos & m_mask];
+    if (c->seq.load(std::memory_order_acquire) != pos + 1) {
+      return 0;
+    }
+    return c->stamp.load(std::memory_order_relaxed);
+  }
+
+  /* 队列中元素数的估计值，并发修改时可能不准确 */
+  size_t size() const {
+    size_t enqueue = m_enqueue_pos.load(std::memory_order_relaxed);
+    size_t dequeue = m_dequeue_pos.load(std::memory_order_relaxed);
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+  }
+
+private:
+  struct cell {
+    std::atomic<size_t> seq;
+    T *data;
+    /* 队首可能被其他线程读取，因此是原子的 */
+    std::atomic<int64_t> stamp;
+  };
+
+  /* 生产者和消费者修改的位置分开放在不同的缓存行 */
+  cell *m_cells;
+  size_t m_mask;
+  char m_pad0[64];
+  std::atomic<size_t> m_enqueue_pos;
+  char m_pad1[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> m_dequeue_pos;
+};
+
+#endif
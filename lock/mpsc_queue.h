@@ -0,0 +1,46 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+/* 多生产者单消费者的无锁队列
+ * 侵入式：链接指针是元素自己的成员 Next，入队不申请内存，
+ * 同一个元素在被消费者取出之前不能再次入队。
+ * 生产者用 CAS 把元素压到栈顶，消费者一次取走整个栈并反转为先进先出的顺序。
+ */
+template <typename T, T *T::*Next> class mpsc_queue {
+
+public:
+  mpsc_queue() : m_head(NULL) {}
+
+  /* 由任意线程调用，返回入队前队列是否为空，为空时调用者需要唤醒消费者 */
+  bool push(T *node) {
+    T *head = m_head.load(std::memory_order_relaxed);
+    do {
+      node->*Next = head;
+    } while (!m_head.compare_exchange_weak(head, node,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed));
+    return head == NULL;
+  }
+
+  /* 由消费者线程调用，取出所有元素，按入队顺序用 Next 串起来
+   * 处理一个元素之前要先读出它的 Next，处理之后元素可能再次入队 */
+  T *pop_all() {
+    T *node = m_head.exchange(NULL, std::memory_order_acquire);
+    T *list = NULL;
+    while (node) {
+      T *next = node->*Next;
+      node->*Next = list;
+      list = node;
+      node = next;
+    }
+    return list;
+  }
+
+private:
+  std::atomic<T *> m_head;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef STEAL_DEQUE_H
+#define STEAL_DEQUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+/* Chase-Lev 工作窃取双端队列(固定容量)
+ * 只有拥有者线程在底部 push 和 pop，其他线程从顶部 steal。
+ * 拥有者的 push/pop 在没有竞争时只有普通的读写和一次内存屏障，
+ * 只有队列中剩最后一个元素时拥有者才和窃取者用 CAS 竞争。
+ * 容量必须是2的幂，队列满时 push 返回 false，由调用者另行处理。
+ */
+template <typename T, int CAPACITY> class steal_deque {
+
+public:
+  steal_deque() : m_top(0), m_bottom(0) {
+    for (int i = 0; i < CAPACITY; ++i) {
+      m_items[i].store(NULL, std::memory_order_relaxed);
+    }
+  }
+
+  /* 只由拥有者调用 */
+  bool push(T *item) {
+    long b = m_bottom.load(std::memory_order_relaxed);
+    long t = m_top.load(std::memory_order_acquire);
+    if (b - t >= CAPACITY) {
+      return false;
+    }
+    m_items[b & (CAPACITY - 1)].store(item, std::memory_order_relaxed);
+    /* 窃取者读到新的 m_bottom 时一定能看到元素以及放入之前对元素的修改 */
+    m_bottom.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* 只由拥有者调用，取最后放入的元素，为空时返回 NULL */
+  T *pop() {
+    long b = m_bottom.load(std::memory_order_relaxed) - 1;
+    m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = m_top.load(std::memory_order_relaxed);
+    if (t > b) {
+      m_bottom.store(b + 1, std::memory_order_relaxed);
+      return NULL;
+    }
+    T *item = m_items[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+    if (t == b) {
+      /* 最后一个元素，和窃取者竞争 */
+      if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+        item = NULL;
+      }
+      m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  /* 由任意线程调用，取最早放入的元素，为空或竞争失败时返回 NULL */
+  T *steal() {
+    long t = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long b = m_bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return NULL;
+    }
+    T *item = m_items[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+    if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+      return NULL;
+    }
+    return item;
+  }
+
+  /* 由任意线程调用，结果只是一个估计 */
+  bool empty() const {
+    long b = m_bottom.load(std::memory_order_acquire);
+    long t = m_top.load(std::memory_order_acquire);
+    return t >= b;
+  }
+
+private:
+  /* 窃取者修改 m_top，拥有者修改 m_bottom，分开放在不同的缓存行 */
+  std::atomic<long> m_top;
+  char m_pad[64 - sizeof(std::atomic<long>)];
+  std::atomic<long> m_bottom;
+  std::atomic<T *> m_items[CAPACITY];
+};
+
+#endif
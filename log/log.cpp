@@ -145,7 +145,13 @@ void Log::write_log(int level, const char *format, ...) {
                    my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
 
   //内容格式化，用于向字符串中打印数据、数据格式用户自定义，返回写入到字符数组str中的字符个数(不包含终止符)
-  int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
+  int m = vsnprintf(m_buf + n, m_log_buf_size - n - 1, format, valst);
+  //超长的内容被截断，留出换行符和结尾的null字符
+  if (m < 0) {
+    m = 0;
+  } else if (m > m_log_buf_size - n - 2) {
+    m = m_log_buf_size - n - 2;
+  }
   m_buf[n + m] = '\n';
   m_buf[n + m + 1] = '\0';
   log_str = m_buf;
@@ -5,46 +5,28 @@
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "./CGImysql/sql_executor.h"
+#include "./cache/file_cache.h"
+#include "./cache/response_cache.h"
+#include "./http/conn_table.h"
 #include "./http/http_conn.h"
 #include "./lock/locker.h"
 #include "./log/log.h"
+#include "./reactor/event_loop.h"
+#include "./reactor/uring_loop.h"
 #include "./threadpool/threadpool.h"
 #include "./timer/lst_timer.h"
 
-#define MAX_FD 65536           //最大文件描述符
-#define MAX_EVENT_NUMBER 10000 //最大事件数
-#define TIMESLOT 5             //最小超时单位
-
 #define SYNLOG //同步写日志
 //#define ASYNLOG //异步写日志
 
-//#define LISTENFDET //边缘触发非阻塞
-#define LISTENFDLT //水平触发阻塞
-
-/* 定义在 http_conn.cpp 中，用于修改描述符 */
-extern int addfd(int epollfd, int fd, bool one_shot);
-extern int removefd(int epollfd, int fd);
-extern int setnonblocking(int fd);
-
-/* 设置定时器相关参数 */
-static int pipefd[2];
-static sort_timer_lst timer_lst;
-static int epollfd = 0;
-
-/* 信号处理函数 */
-void sig_handler(int sig) {
-  /* 为保证函数的可重入性，保留原来的errno */
-  int save_errno = errno;
-  int msg = sig;
-  send(pipefd[1], (char *)&msg, 1, 0);
-  errno = save_errno;
-}
-
 void addsig(int sig, void(handler)(int), bool restart = true) {
   struct sigaction sa;
   memset(&sa, '\0', sizeof(sa));
@@ -56,32 +38,22 @@ void addsig(int sig, void(handler)(int), bool restart = true) {
   assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-//定时处理任务，重新定时以不断触发SIGALRM信号
-void timer_handler() {
-  timer_lst.tick();
-  alarm(TIMESLOT);
-}
-
-//定时器回调函数，删除非活动连接在socket上的注册事件，并关闭
-void cb_func(client_data *user_data) {
-  epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
-  assert(user_data);
-  close(user_data->sockfd);
-  // printf("close fd: %d \n", user_data->sockfd);
-
-  http_conn::m_user_count--;
-  LOG_INFO("close fd %d", user_data->sockfd);
-  Log::get_instance()->flush();
-}
-
-void show_error(int connfd, const char *info) {
-  printf("%s", info);
-  send(connfd, info, strlen(info), 0);
-  close(connfd);
-}
-
 int main(int argc, char *argv[]) {
 
+  /* 在创建任何线程之前屏蔽 SIGTERM，之后创建的线程都继承该屏蔽字，
+   * 信号只能通过 signalfd 读取，由第0个事件循环在 epoll 中处理 */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+    return 1;
+  }
+  int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigfd == -1) {
+    printf("signalfd failure\n");
+    return 1;
+  }
+
 #ifdef ASYNLOG
   Log::get_instance()->init("ServerLog", 2000, 800000, 8); //异步日志模型
 #endif
@@ -91,263 +63,131 @@ int main(int argc, char *argv[]) {
 #endif
 
   if (argc <= 2) {
-    printf("usage: %s ip_address port_number\n", basename(argv[0]));
+    printf("usage: %s ip_address port_number [reactor_number] [io_uring]\n",
+           basename(argv[0]));
     return 1;
   }
   const char *ip = argv[1];
   int port = atoi(argv[2]);
+  /* 事件循环数量，默认1个，即原来的单 reactor 模型 */
+  int reactor_number = 1;
+  if (argc > 3) {
+    reactor_number = atoi(argv[3]);
+  }
+  if (reactor_number <= 0 || reactor_number > MAX_REACTOR) {
+    printf("reactor_number must be in [1, %d]\n", MAX_REACTOR);
+    return 1;
+  }
+  /* I/O后端，0 为 epoll(默认)，1 为 io_uring(需要以 USE_IO_URING 编译) */
+  int use_io_uring = 0;
+  if (argc > 4) {
+    use_io_uring = atoi(argv[4]);
+  }
+#ifndef USE_IO_URING
+  if (use_io_uring) {
+    printf("io_uring backend is not compiled in, rebuild with "
+           "USE_IO_URING\n");
+    return 1;
+  }
+#endif
 
   /* 忽略SIGPIPE信号 */
   addsig(SIGPIPE, SIG_IGN);
 
   //创建数据库连接池
+  const int sql_num = 8;
+  /* 启动时建立的连接数，其余按需建立，空闲超时后关闭 */
+  const int sql_min_num = 2;
+  /* 没有空闲连接时最多等待的毫秒数，超时的注册请求应答 503 */
+  const int sql_wait_ms = 500;
+  /* 执行线程(写线程)数，注册的 INSERT 在其中按批合并提交，线程越少每批越大 */
+  const int sql_writer_num = 2;
   connection_pool *connPool = connection_pool::GetInstance();
-  connPool->init("localhost", "root", "admin", "WebServer", 3306, 8);
+  connPool->init("localhost", "root", "admin", "WebServer", 3306, sql_num,
+                 sql_min_num, sql_wait_ms);
 
   /* 创建线程池 */
   threadpool<http_conn> *pool = NULL;
   try {
-    pool = new threadpool<http_conn>(connPool);
+    pool = new threadpool<http_conn>();
   } catch (...) {
     return 1;
   }
+  /* 登录和注册请求最多占用与数据库连接数相同的线程，其余线程处理静态请求 */
+  pool->set_class_limit(http_conn::REQUEST_CGI, sql_num);
 
-  /* 预先为每个可能的客户连接分配一个http_conn 对象 */
-  http_conn *users = new http_conn[MAX_FD];
-  assert(users);
+  /* 连接表按描述符分页，有连接时才分配对应页的 http_conn 对象 */
+  if (!conn_table::get_instance()->init()) {
+    printf("getrlimit RLIMIT_NOFILE failure\n");
+    return 1;
+  }
 
   //初始化数据库读取表
-  users->initmysql_result(connPool);
-
-  int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-  assert(listenfd >= 0);
-  // struct linger tmp = {1, 0};
-  // SO_LINGER若有数据待发送，延迟关闭
-  // setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
-
-  int ret = 0;
-  struct sockaddr_in address;
-  bzero(&address, sizeof(address));
-  address.sin_family = AF_INET;
-  inet_pton(AF_INET, ip, &address.sin_addr);
-  // address.sin_addr.s_addr = htonl(INADDR_ANY);
-  address.sin_port = htons(port);
-
-  int flag = 1;
-  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-  ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-  assert(ret >= 0);
-  ret = listen(listenfd, 5);
-  assert(ret >= 0);
-
-  /* 创建内核事件表 */
-  epoll_event events[MAX_EVENT_NUMBER];
-  int epollfd = epoll_create(5);
-  assert(epollfd != -1);
-
-  addfd(epollfd, listenfd, false); // 默认LT模式
-  http_conn::m_epollfd = epollfd;
-
-  /*  创建管道用于定时器 */
-  ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-  assert(ret != -1);
-  setnonblocking(pipefd[1]);
-  addfd(epollfd, pipefd[0], false);
-
-  addsig(SIGALRM, sig_handler, false);
-  addsig(SIGTERM, sig_handler, false);
-  bool stop_server = false;
-
-  client_data *users_timer = new client_data[MAX_FD];
-
-  bool timeout = false;
-  alarm(TIMESLOT);
-
-  while (!stop_server) {
-    int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-    if ((number < 0) && (errno != EINTR)) {
-      // printf("epoll failure\n");
-      LOG_ERROR("%s", "epoll failure");
-      break;
-    }
-
-    for (int i = 0; i < number; i++) {
-      int sockfd = events[i].data.fd;
-      if (sockfd == listenfd) {
-        struct sockaddr_in client_address;
-        socklen_t client_addrlength = sizeof(client_address);
-
-#ifdef LISTENFDLT
-        int connfd = accept(listenfd, (struct sockaddr *)&client_address,
-                            &client_addrlength);
-        if (connfd < 0) {
-          // printf("errno is: %d\n", errno);
-          LOG_ERROR("%s:errno is:%d", "accept error", errno);
-          continue;
-        }
-        if (http_conn::m_user_count >= MAX_FD) {
-          show_error(connfd, "Internal server busy");
-          LOG_ERROR("%s", "Internal server busy");
-          continue;
-        }
-        /* 初始化客户连接 */
-        users[connfd].init(connfd, client_address);
-
-        //初始化client_data数据
-        //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
-
-        users_timer[connfd].address = client_address;
-        users_timer[connfd].sockfd = connfd;
-        util_timer *timer = new util_timer;
-        timer->user_data = &users_timer[connfd];
-        timer->cb_func = cb_func;
-        time_t cur = time(NULL);
-        timer->expire = cur + 3 * TIMESLOT;
-        users_timer[connfd].timer = timer;
-        timer_lst.add_timer(timer);
+  http_conn::initmysql_result(connPool);
+  /* 注册请求的 INSERT 交给执行线程合并提交，协程版本中注册请求挂起等待，
+   * 否则工作线程阻塞到所在的批次提交 */
+  if (!sql_executor::get_instance()->init(connPool, sql_writer_num)) {
+    printf("create sql executor failure\n");
+    return 1;
+  }
 
+  /* 缓存文档根目录下文件的 stat 结果和描述符，由 inotify 负责失效 */
+  file_cache::get_instance()->init(doc_root);
+  /* 热点小文件缓存完整应答，命中时直接发送共享的应答头和文件内容 */
+  response_cache::get_instance()->init(http_conn::RESPONSE_CACHE_BUDGET,
+                                       http_conn::RESPONSE_CACHE_FILE_SIZE);
+
+  /* 每个事件循环拥有自己的监听socket、epoll和定时器链表 */
+  event_loop *loops[MAX_REACTOR];
+  for (int i = 0; i < reactor_number; ++i) {
+#ifdef USE_IO_URING
+    if (use_io_uring) {
+      loops[i] = new uring_loop(i, pool);
+    } else
 #endif
-
-#ifdef listenfdET
-        while (1) {
-          int connfd = accept(listenfd, (struct sockaddr *)&client_address,
-                              &client_addrlength);
-          if (connfd < 0) {
-            LOG_ERROR("%s:errno is:%d", "accept error", errno);
-            break;
-          }
-          if (http_conn::m_user_count >= MAX_FD) {
-            show_error(connfd, "Internal server busy");
-            LOG_ERROR("%s", "Internal server busy");
-            break;
-          }
-          users[connfd].init(connfd, client_address);
-
-          //初始化client_data数据
-          //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
-          users_timer[connfd].address = client_address;
-          users_timer[connfd].sockfd = connfd;
-          util_timer *timer = new util_timer;
-          timer->user_data = &users_timer[connfd];
-          timer->cb_func = cb_func;
-          time_t cur = time(NULL);
-          timer->expire = cur + 3 * TIMESLOT;
-          users_timer[connfd].timer = timer;
-          timer_lst.add_timer(timer);
-        }
-        continue;
+      loops[i] = new event_loop(i, pool);
+    bool ret = loops[i]->init(ip, port, reactor_number > 1,
+                              i == 0 ? sigfd : -1);
+    assert(ret);
+#ifdef USE_COROUTINE
+    /* 每个事件循环自己驱动的非阻塞数据库连接数 */
+    const int sql_async_num = 4;
+    /* 客户端库没有非阻塞接口时，语句仍由执行线程完成 */
+    if (!loops[i]->init_sql(connPool, sql_async_num)) {
+      LOG_INFO("event loop %d: no non-blocking sql connection", i);
+    }
 #endif
+  }
 
-      } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-
-        //服务器端关闭连接，移除对应的定时器
-        util_timer *timer = users_timer[sockfd].timer;
-        timer->cb_func(&users_timer[sockfd]);
-
-        if (timer) {
-          timer_lst.del_timer(timer);
-        }
-
-      }
-      //处理信号
-      else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN)) {
-        int sig;
-        char signals[1024];
-        ret = recv(pipefd[0], signals, sizeof(signals), 0);
-        if (ret == -1) {
-          continue;
-        } else if (ret == 0) {
-          continue;
-        } else {
-          for (int i = 0; i < ret; ++i) {
-            switch (signals[i]) {
-            case SIGALRM: {
-              timeout = true;
-              break;
-            }
-            case SIGTERM: {
-              stop_server = true;
-            }
-            }
-          }
-        }
-      }
-
-      /* 处理客户连接上接收到的数据 */
-      else if (events[i].events & EPOLLIN) {
-        /* 根据读的结果，决定和是将任务添加到线程池还是关闭连接 */
-        util_timer *timer = users_timer[sockfd].timer;
-        if (users[sockfd].read()) {
-
-          LOG_INFO("deal with the client(%s)",
-                   inet_ntoa(users[sockfd].get_address()->sin_addr));
-          Log::get_instance()->flush();
-
-          /* 如果监测到读事件，将该事件放入请求队列 */
-          pool->append(users + sockfd);
-
-          /* 若有数据传输，则将定时器往后延迟3个单位
-           * 并对新的定时器在链表上的位置进行调整
-           */
-          if (timer) {
-            time_t cur = time(NULL);
-            timer->expire = cur + 3 * TIMESLOT;
-
-            LOG_INFO("%s", "adjust timer once");
-            Log::get_instance()->flush();
-
-            timer_lst.adjust_timer(timer);
-          }
-
-        } else {
-          timer->cb_func(&users_timer[sockfd]);
-          if (timer) {
-            timer_lst.del_timer(timer);
-          }
-
-          // users[sockfd].close_conn();
-        }
-      } else if (events[i].events & EPOLLOUT) {
-        /* 根据写的结果决定是否关闭 */
-        util_timer *timer = users_timer[sockfd].timer;
-        if (users[sockfd].write()) {
-
-          LOG_INFO("send data to the client(%s)",
-                   inet_ntoa(users[sockfd].get_address()->sin_addr));
-          Log::get_instance()->flush();
-
-          /* 若有数据传输，则将定时器往后延迟3个单位
-           * 并对新的定时器在链表上的位置进行调整
-           */
-          if (timer) {
-            time_t cur = time(NULL);
-            timer->expire = cur + 3 * TIMESLOT;
-
-            LOG_INFO("%s", "adjust timer once");
-            Log::get_instance()->flush();
-
-            timer_lst.adjust_timer(timer);
-          }
-        } else {
-          timer->cb_func(&users_timer[sockfd]);
-          if (timer) {
-            timer_lst.del_timer(timer);
-          }
-        }
-      }
-    }
-    if (timeout) {
-      timer_handler();
-      timeout = false;
+  /* 第0个事件循环在主线程中运行，其余每个事件循环一个线程 */
+  pthread_t tids[MAX_REACTOR];
+  for (int i = 1; i < reactor_number; ++i) {
+    if (pthread_create(tids + i, NULL, event_loop::worker, loops[i]) != 0) {
+      LOG_ERROR("%s", "create event loop thread failure");
+      return 1;
     }
   }
+  loops[0]->loop();
 
-  close(epollfd);
-  close(listenfd);
-  close(pipefd[1]);
-  close(pipefd[0]);
-  delete[] users;
-  delete[] users_timer;
+  /* 第0个事件循环收到 SIGTERM 后退出，再通知其余的事件循环 */
+  for (int i = 1; i < reactor_number; ++i) {
+    loops[i]->stop();
+    pthread_join(tids[i], NULL);
+  }
+  /* 先回收数据库执行线程和线程池，正在处理的请求完成后还要把结果交给所属的事件循环 */
+  sql_executor::get_instance()->stop();
   delete pool;
+  for (int i = 0; i < reactor_number; ++i) {
+    delete loops[i];
+  }
+
+  pool_stats stats;
+  connPool->GetStats(&stats);
+  LOG_INFO("sql pool: %u connections, %lu acquires, %lu waits (avg %llu us, "
+           "max %llu us), %lu failed, %lu connect failures, %lu dropped",
+           stats.total, stats.acquires, stats.waits,
+           stats.waits ? stats.wait_us / stats.waits : 0, stats.max_wait_us,
+           stats.timeouts, stats.connect_failures, stats.broken);
+  close(sigfd);
   return 0;
 }
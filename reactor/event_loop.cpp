@@ -0,0 +1,532 @@
+#include "event_loop.h"
+#include "../log/log.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+//#define LISTENFDET //边缘触发非阻塞
+#define LISTENFDLT //水平触发阻塞
+
+/* 定义在 http_conn.cpp 中，用于修改描述符 */
+extern void addfd(int epollfd, int fd, bool one_shot);
+extern void modfd(int epollfd, int fd, int ev);
+extern int setnonblocking(int fd);
+
+//定时器回调函数，删除非活动连接在socket上的注册事件，并关闭
+static void cb_func(client_data *user_data) {
+  assert(user_data);
+  int sockfd = user_data->sockfd;
+  user_data->timer = NULL;
+  if (user_data->busy) {
+    /* 工作线程正在处理，等交还给事件循环后再关闭 */
+    user_data->expired = true;
+    return;
+  }
+  conn_table::get_instance()->conn(sockfd)->release_buffers();
+  epoll_ctl(user_data->epollfd, EPOLL_CTL_DEL, sockfd, 0);
+  close(sockfd);
+  // printf("close fd: %d \n", sockfd);
+
+  http_conn::m_user_count--;
+  LOG_INFO("close fd %d", sockfd);
+  Log::get_instance()->flush();
+  /* 最后归还连接表中的位置，之后 user_data 可能随所在页一起被回收 */
+  conn_table::get_instance()->release(sockfd);
+}
+
+void event_loop::show_error(int connfd, const char *info) {
+  printf("%s", info);
+  send(connfd, info, strlen(info), 0);
+  ::close(connfd);
+}
+
+event_loop::event_loop(int id, threadpool<http_conn> *pool)
+    : m_id(id), m_listenfd(-1), m_epollfd(-1), m_signalfd(-1), m_timerfd(-1),
+      m_wakeupfd(-1), m_stop(false), m_sql(NULL),
+      m_last_shrink(monotonic_ms()),
+      m_conns(conn_table::get_instance()), m_pool(pool) {}
+
+bool event_loop::is_full(int connfd) const {
+  return http_conn::m_user_count >= m_conns->max_fd() ||
+         connfd >= m_conns->max_fd();
+}
+
+event_loop::~event_loop() {
+  delete m_sql;
+  if (m_epollfd != -1) {
+    ::close(m_epollfd);
+  }
+  if (m_listenfd != -1) {
+    ::close(m_listenfd);
+  }
+  if (m_timerfd != -1) {
+    ::close(m_timerfd);
+  }
+  if (m_wakeupfd != -1) {
+    ::close(m_wakeupfd);
+  }
+}
+
+bool event_loop::open_listen(const char *ip, int port, bool reuseport) {
+  m_listenfd = socket(PF_INET, SOCK_STREAM, 0);
+  if (m_listenfd < 0) {
+    return false;
+  }
+  // struct linger tmp = {1, 0};
+  // SO_LINGER若有数据待发送，延迟关闭
+  // setsockopt(m_listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+
+  struct sockaddr_in address;
+  bzero(&address, sizeof(address));
+  address.sin_family = AF_INET;
+  inet_pton(AF_INET, ip, &address.sin_addr);
+  // address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+
+  int flag = 1;
+  setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+  /* 每个事件循环各自绑定同一端口，由内核按连接哈希分发到各监听socket */
+  if (reuseport &&
+      setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag))) {
+    LOG_ERROR("%s:errno is:%d", "SO_REUSEPORT error", errno);
+    return false;
+  }
+  if (bind(m_listenfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    return false;
+  }
+  if (listen(m_listenfd, 5) < 0) {
+    return false;
+  }
+
+  /* 单调时钟的周期定时器，每 TIMER_TICK 毫秒检查一次到期的定时器 */
+  m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (m_timerfd == -1) {
+    return false;
+  }
+  struct itimerspec its;
+  its.it_interval.tv_sec = TIMER_TICK / 1000;
+  its.it_interval.tv_nsec = (TIMER_TICK % 1000) * 1000000;
+  its.it_value = its.it_interval;
+  if (timerfd_settime(m_timerfd, 0, &its, NULL) == -1) {
+    return false;
+  }
+
+  /* 工作线程交还连接或其他线程要求退出时通过 eventfd 唤醒事件循环 */
+  m_wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeupfd == -1) {
+    return false;
+  }
+  return true;
+}
+
+bool event_loop::init(const char *ip, int port, bool reuseport,
+                      int signalfd) {
+  if (!open_listen(ip, port, reuseport)) {
+    return false;
+  }
+  m_signalfd = signalfd;
+
+  /* 创建内核事件表 */
+  m_epollfd = epoll_create(5);
+  if (m_epollfd == -1) {
+    return false;
+  }
+  addfd(m_epollfd, m_listenfd, false); // 默认LT模式
+  addfd(m_epollfd, m_timerfd, false);
+  addfd(m_epollfd, m_wakeupfd, false);
+  if (m_signalfd != -1) {
+    addfd(m_epollfd, m_signalfd, false);
+  }
+  return true;
+}
+
+void event_loop::stop() {
+  m_stop = true;
+  uint64_t one = 1;
+  ::write(m_wakeupfd, &one, sizeof(one));
+}
+
+void *event_loop::worker(void *arg) {
+  event_loop *loop = (event_loop *)arg;
+  loop->loop();
+  return loop;
+}
+
+void event_loop::add_client(int connfd, const sockaddr_in &client_address) {
+  /* 初始化客户连接，注册到本事件循环的epoll内核事件表 */
+  m_conns->acquire(connfd)->init(connfd, client_address, m_epollfd, this);
+
+  //初始化client_data数据
+  //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
+  client_data *user_data = m_conns->data(connfd);
+  user_data->address = client_address;
+  user_data->sockfd = connfd;
+  user_data->epollfd = m_epollfd;
+  util_timer *timer = &user_data->timer_node;
+  timer->user_data = user_data;
+  timer->cb_func = cb_func;
+  /* 新连接从接受起就要在期限内发送完请求头 */
+  timer->expire = monotonic_ms() + HEADER_TIMEOUT;
+  user_data->timer = timer;
+  user_data->phase = PHASE_HEADER;
+  user_data->busy = false;
+  user_data->expired = false;
+  m_timer_lst.add_timer(timer);
+}
+
+void event_loop::deal_with_accept() {
+  struct sockaddr_in client_address;
+  socklen_t client_addrlength = sizeof(client_address);
+
+#ifdef LISTENFDLT
+  int connfd = accept(m_listenfd, (struct sockaddr *)&client_address,
+                      &client_addrlength);
+  if (connfd < 0) {
+    // printf("errno is: %d\n", errno);
+    LOG_ERROR("%s:errno is:%d", "accept error", errno);
+    return;
+  }
+  if (is_full(connfd)) {
+    show_error(connfd, "Internal server busy");
+    LOG_ERROR("%s", "Internal server busy");
+    return;
+  }
+  add_client(connfd, client_address);
+#endif
+
+#ifdef LISTENFDET
+  while (1) {
+    int connfd = accept(m_listenfd, (struct sockaddr *)&client_address,
+                        &client_addrlength);
+    if (connfd < 0) {
+      LOG_ERROR("%s:errno is:%d", "accept error", errno);
+      break;
+    }
+    if (is_full(connfd)) {
+      show_error(connfd, "Internal server busy");
+      LOG_ERROR("%s", "Internal server busy");
+      break;
+    }
+    add_client(connfd, client_address);
+  }
+#endif
+}
+
+void event_loop::deal_with_signal(bool &stop_loop) {
+  struct signalfd_siginfo info;
+  while (read(m_signalfd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGTERM) {
+      stop_loop = true;
+    }
+  }
+}
+
+void event_loop::deal_with_timer() {
+  uint64_t expirations;
+  if (read(m_timerfd, &expirations, sizeof(expirations)) > 0) {
+    timer_handler();
+  }
+}
+
+void event_loop::deal_with_wakeup(bool &stop_loop) {
+  uint64_t value;
+  while (read(m_wakeupfd, &value, sizeof(value)) > 0) {
+  }
+  /* 先读 eventfd 再取邮箱，之后放入的命令会再次唤醒 */
+  http_conn *conn = m_mailbox.pop_all();
+  while (conn) {
+    /* 执行命令后连接可能又交给线程池并再次入队，先取出下一个 */
+    http_conn *next = conn->m_next_command;
+    run_command(conn, conn->m_command);
+    conn = next;
+  }
+  sql_request *req = m_sql_queue.pop_all();
+  while (req) {
+    /* 排队时 next 会被改写 */
+    sql_request *next = req->next;
+    m_sql->submit(req);
+    req = next;
+  }
+  if (m_stop) {
+    stop_loop = true;
+  }
+}
+
+void event_loop::rearm(http_conn *conn, int ev) {
+  conn->m_command = ev;
+  /* 邮箱由空变为非空时才需要唤醒，事件循环一次取走所有命令 */
+  if (m_mailbox.push(conn)) {
+    uint64_t one = 1;
+    ::write(m_wakeupfd, &one, sizeof(one));
+  }
+}
+
+void event_loop::close(http_conn *conn) { rearm(conn, 0); }
+
+void event_loop::reschedule(http_conn *conn) {
+  rearm(conn, COMMAND_RESCHEDULE);
+}
+
+bool event_loop::init_sql(connection_pool *connPool, int conn_number) {
+  m_sql = new sql_async();
+  if (!m_sql->init(connPool, conn_number, this)) {
+    delete m_sql;
+    m_sql = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool event_loop::submit_sql(sql_request *req) {
+  if (!m_sql || !m_sql->available()) {
+    return false;
+  }
+  if (m_sql_queue.push(req)) {
+    uint64_t one = 1;
+    ::write(m_wakeupfd, &one, sizeof(one));
+  }
+  return true;
+}
+
+void event_loop::watch(int fd, int events) {
+  if (events == 0) {
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, 0);
+    return;
+  }
+  epoll_event event;
+  event.data.fd = fd;
+  event.events = EPOLLONESHOT;
+  if (events & SQL_WAIT_READ) {
+    event.events |= EPOLLIN;
+  }
+  if (events & SQL_WAIT_WRITE) {
+    event.events |= EPOLLOUT;
+  }
+  /* 第一次监听时注册 */
+  if (epoll_ctl(m_epollfd, EPOLL_CTL_MOD, fd, &event) == -1 && errno == ENOENT) {
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+void event_loop::dispatch(int sockfd) {
+  client_data *user_data = m_conns->data(sockfd);
+  user_data->busy = true;
+  if (!m_pool->append(m_conns->conn(sockfd))) {
+    /* 请求队列已满，拒绝该请求并关闭连接，连接上没有注册任何事件，
+     * 不能留给定时器处理 */
+    user_data->busy = false;
+    static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                               "Content-Length: 0\r\n"
+                               "Connection: close\r\n\r\n";
+    send(sockfd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    LOG_ERROR("%s", "request queue full");
+    close_client(sockfd);
+  }
+}
+
+void event_loop::run_command(http_conn *conn, int ev) {
+  int sockfd = conn->get_sockfd();
+  client_data *user_data = m_conns->data(sockfd);
+  user_data->busy = false;
+  if (ev == 0 || user_data->expired) {
+    close_client(sockfd);
+    return;
+  }
+  if (ev == COMMAND_RESCHEDULE) {
+    /* 请求还没有处理完，由线程池从挂起处继续 */
+    dispatch(sockfd);
+    return;
+  }
+  if (ev == EPOLLOUT) {
+    /* 请求处理完毕，从现在起计算发送期限 */
+    set_phase(sockfd, PHASE_WRITE);
+  }
+  resume(sockfd, ev);
+}
+
+void event_loop::resume(int sockfd, int ev) {
+  modfd(m_epollfd, sockfd, ev);
+}
+
+void event_loop::close_client(int sockfd) {
+  deal_timer(m_conns->data(sockfd)->timer, sockfd);
+}
+
+void event_loop::set_phase(int sockfd, int phase) {
+  client_data *user_data = m_conns->data(sockfd);
+  util_timer *timer = user_data->timer;
+  if (!timer) {
+    return;
+  }
+  int timeout = IDLE_TIMEOUT;
+  switch (phase) {
+  case PHASE_HEADER: {
+    timeout = HEADER_TIMEOUT;
+    break;
+  }
+  case PHASE_BODY: {
+    timeout = BODY_TIMEOUT;
+    break;
+  }
+  case PHASE_WRITE: {
+    timeout = WRITE_TIMEOUT;
+    break;
+  }
+  }
+  user_data->phase = phase;
+  timer->expire = monotonic_ms() + timeout;
+
+  LOG_INFO("%s", "adjust timer once");
+  Log::get_instance()->flush();
+
+  m_timer_lst.adjust_timer(timer);
+}
+
+void event_loop::update_read_phase(int sockfd) {
+  /* 解析状态是上一次处理时留下的，请求头接收完之后的下一次读才进入请求体阶段，
+   * 同一阶段内收到数据不延长期限 */
+  int phase = m_conns->data(sockfd)->phase;
+  if (m_conns->conn(sockfd)->reading_body()) {
+    if (phase != PHASE_BODY) {
+      set_phase(sockfd, PHASE_BODY);
+    }
+  } else if (phase != PHASE_HEADER) {
+    set_phase(sockfd, PHASE_HEADER);
+  }
+}
+
+void event_loop::update_write_phase(int sockfd) {
+  http_conn *conn = m_conns->conn(sockfd);
+  if (conn->is_writing()) {
+    /* 发送有进展，重新计算发送期限 */
+    set_phase(sockfd, PHASE_WRITE);
+  } else if (conn->has_pending_request()) {
+    /* 流水线中的下一个请求已经开始到达 */
+    set_phase(sockfd, PHASE_HEADER);
+  } else {
+    set_phase(sockfd, PHASE_IDLE);
+  }
+}
+
+void event_loop::deal_timer(util_timer *timer, int sockfd) {
+  /* 先移除定时器，回调归还连接表中的位置后节点可能随所在页被回收 */
+  m_timer_lst.del_timer(timer);
+  cb_func(m_conns->data(sockfd));
+}
+
+void event_loop::deal_with_read(int sockfd) {
+  /* 根据读的结果，决定和是将任务添加到线程池还是关闭连接 */
+  util_timer *timer = m_conns->data(sockfd)->timer;
+  if (m_conns->conn(sockfd)->read()) {
+
+    LOG_INFO("deal with the client(%s)",
+             inet_ntoa(m_conns->conn(sockfd)->get_address()->sin_addr));
+    Log::get_instance()->flush();
+
+    /* 按连接所处的阶段调整定时器，交给线程池之后不能再访问连接的解析状态 */
+    update_read_phase(sockfd);
+
+    /* 如果监测到读事件，将该事件放入请求队列 */
+    dispatch(sockfd);
+  } else {
+    deal_timer(timer, sockfd);
+  }
+}
+
+void event_loop::deal_with_write(int sockfd) {
+  /* 根据写的结果决定是否关闭 */
+  util_timer *timer = m_conns->data(sockfd)->timer;
+  if (m_conns->conn(sockfd)->write()) {
+
+    LOG_INFO("send data to the client(%s)",
+             inet_ntoa(m_conns->conn(sockfd)->get_address()->sin_addr));
+    Log::get_instance()->flush();
+
+    update_write_phase(sockfd);
+
+    /* 读缓冲中还有流水线请求，直接交给线程池 */
+    if (m_conns->conn(sockfd)->has_pending_request()) {
+      dispatch(sockfd);
+    }
+  } else {
+    deal_timer(timer, sockfd);
+  }
+}
+
+//定时处理任务，由 timerfd 每 TIMER_TICK 毫秒触发一次
+void event_loop::timer_handler() {
+  m_timer_lst.tick();
+  /* 空页不必及时回收，降低扫描连接表的频率 */
+  int64_t now = monotonic_ms();
+  if (now - m_last_shrink >= SHRINK_INTERVAL) {
+    m_conns->shrink();
+    m_last_shrink = now;
+  }
+}
+
+void event_loop::loop() {
+  bool timeout = false;
+  bool stop_loop = false;
+
+  LOG_INFO("event loop %d start", m_id);
+  Log::get_instance()->flush();
+
+  while (!stop_loop) {
+    int number = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+    if ((number < 0) && (errno != EINTR)) {
+      // printf("epoll failure\n");
+      LOG_ERROR("%s", "epoll failure");
+      break;
+    }
+
+    for (int i = 0; i < number; i++) {
+      int sockfd = m_events[i].data.fd;
+      if (sockfd == m_listenfd) {
+        deal_with_accept();
+      }
+      //定时事件优先级较低，处理完本轮I/O事件之后再处理
+      else if (sockfd == m_timerfd) {
+        timeout = true;
+      }
+      //处理信号
+      else if (sockfd == m_signalfd) {
+        deal_with_signal(stop_loop);
+      } else if (sockfd == m_wakeupfd) {
+        deal_with_wakeup(stop_loop);
+      } else if (m_sql && m_sql->owns(sockfd)) {
+        /* 出错或挂断时让客户端库在继续执行时发现 */
+        int ready = 0;
+        if (m_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          ready |= SQL_WAIT_READ;
+        }
+        if (m_events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+          ready |= SQL_WAIT_WRITE;
+        }
+        m_sql->on_event(sockfd, ready);
+      } else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        //服务器端关闭连接，移除对应的定时器
+        deal_timer(m_conns->data(sockfd)->timer, sockfd);
+      }
+      /* 处理客户连接上接收到的数据 */
+      else if (m_events[i].events & EPOLLIN) {
+        deal_with_read(sockfd);
+      } else if (m_events[i].events & EPOLLOUT) {
+        deal_with_write(sockfd);
+      }
+    }
+    if (timeout) {
+      deal_with_timer();
+      timeout = false;
+    }
+  }
+
+  LOG_INFO("event loop %d stop", m_id);
+  Log::get_instance()->flush();
+}
@@ -0,0 +1,148 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <atomic>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "../CGImysql/sql_async.h"
+#include "../http/conn_table.h"
+#include "../http/http_conn.h"
+#include "../lock/mpsc_queue.h"
+#include "../threadpool/threadpool.h"
+#include "../timer/lst_timer.h"
+#include "../timer/time_wheel.h"
+
+#define MAX_EVENT_NUMBER 10000 //最大事件数
+#define TIMER_TICK 50          //定时器检查间隔(毫秒)
+#define HEADER_TIMEOUT 10000   //从请求的第一个字节起接收完请求头的期限(毫秒)
+#define BODY_TIMEOUT 30000     //接收完请求体的期限(毫秒)
+#define IDLE_TIMEOUT 15000     //长连接等待下一个请求的期限(毫秒)
+#define WRITE_TIMEOUT 15000    //发送应答时没有任何进展的期限(毫秒)
+#define SHRINK_INTERVAL 5000   //回收连接表空页的间隔(毫秒)
+#define MAX_REACTOR 64         //最大事件循环(reactor)数量
+
+#define TIMER_WHEEL //时间轮定时器，O(1)添加和调整
+//#define TIMER_LIST //升序链表定时器，添加和调整需要遍历链表
+
+/* 事件循环：one loop per thread
+ * 每个 event_loop 独占一个监听socket(SO_REUSEPORT)、一个epoll内核事件表、
+ * 一个定时器、驱动定时器的 timerfd 和一个 eventfd，只处理自己 accept 的连接。
+ * 多个 event_loop 监听同一端口，由内核在它们之间分发新连接。
+ * SIGTERM 通过 signalfd 交给其中一个事件循环，它退出后由主线程停止其余的事件循环。
+ *
+ * 工作线程处理完请求后不直接操作连接的描述符和定时器，而是把命令放入事件循环的
+ * 无锁邮箱并通过 eventfd 唤醒它，由事件循环线程重新注册事件、调整或关闭连接。
+ * 连接交给线程池期间到期的定时器只做标记，等工作线程交还命令后再关闭，
+ * 不会在工作线程处理时关闭描述符或回收连接。
+ *
+ * 可以持有几个非阻塞数据库连接(sql_async)，工作线程挂起的请求的语句经邮箱交给
+ * 事件循环发出，连接的 socket 与客户连接一起监听，结果到达后请求重新交给线程池。
+ */
+class event_loop : public conn_owner, public sql_watcher {
+
+public:
+  event_loop(int id, threadpool<http_conn> *pool);
+  virtual ~event_loop();
+
+  /* 创建监听socket、epoll内核事件表、timerfd 和 eventfd，reuseport 表示与其他
+   * event_loop 共享同一端口，signalfd 不为 -1 时由本事件循环处理信号 */
+  virtual bool init(const char *ip, int port, bool reuseport,
+                    int signalfd = -1);
+  /* 运行事件循环，直到收到 SIGTERM 或 stop() */
+  virtual void loop();
+  /* 由其他线程调用，要求事件循环退出 */
+  void stop();
+  /* 建立 conn_number 个由本事件循环驱动的非阻塞数据库连接，在 loop() 之前调用，
+   * 客户端库不支持时返回 false，语句仍由 sql_executor 执行 */
+  bool init_sql(connection_pool *connPool, int conn_number);
+
+  /* 以下三个函数由工作线程(或数据库执行线程)调用，把命令放入邮箱 */
+  void rearm(http_conn *conn, int ev);
+  void close(http_conn *conn);
+  void reschedule(http_conn *conn);
+  bool submit_sql(sql_request *req);
+
+  /* 监听非阻塞数据库连接的 socket */
+  virtual void watch(int fd, int events);
+
+  /* pthread_create 的线程函数，arg 为 event_loop 指针 */
+  static void *worker(void *arg);
+
+protected:
+  /* 创建监听socket、timerfd 和 eventfd，供各I/O后端共用 */
+  bool open_listen(const char *ip, int port, bool reuseport);
+  /* 读取 signalfd，收到 SIGTERM 时设置 stop_loop */
+  void deal_with_signal(bool &stop_loop);
+  /* 读取 timerfd 并处理到期的定时器 */
+  void deal_with_timer();
+  /* 读取 eventfd，执行邮箱中的命令，发出排队的语句，stop() 之后设置 stop_loop */
+  void deal_with_wakeup(bool &stop_loop);
+  /* 把连接交给线程池，之后直到交还命令前不能访问连接
+   * 线程池的请求队列已满时回复 503 并关闭连接 */
+  void dispatch(int sockfd);
+  /* 挂起的请求等待的操作已完成，重新交给线程池的命令 */
+  static const int COMMAND_RESCHEDULE = -1;
+  /* 工作线程交还连接，ev 为 EPOLLIN、EPOLLOUT、COMMAND_RESCHEDULE，或 0 表示关闭 */
+  void run_command(http_conn *conn, int ev);
+  /* 由各I/O后端实现：继续读取或发送 */
+  virtual void resume(int sockfd, int ev);
+  /* 由各I/O后端实现：关闭连接，移除定时器并归还连接表中的位置 */
+  virtual void close_client(int sockfd);
+  /* 定时处理任务 */
+  void timer_handler();
+  /* 连接所处的阶段，每个阶段有各自的期限，只在进入新阶段时重新设置定时器，
+   * 发送阶段在每次有进展时重新设置，因此一点一点发送请求的客户端无法一直占用连接 */
+  enum CONN_PHASE { PHASE_HEADER = 0, PHASE_BODY, PHASE_IDLE, PHASE_WRITE };
+  /* 连接进入 phase 阶段，按该阶段的期限重新设置定时器 */
+  void set_phase(int sockfd, int phase);
+  /* 收到数据之后更新阶段，必须在交给线程池之前调用 */
+  void update_read_phase(int sockfd);
+  /* 发送之后更新阶段，必须在交给线程池之前调用 */
+  void update_write_phase(int sockfd);
+  /* 关闭连接并移除对应的定时器 */
+  void deal_timer(util_timer *timer, int sockfd);
+  /* 连接数已满时回复错误信息并关闭 */
+  static void show_error(int connfd, const char *info);
+  /* 连接数已满或描述符超出连接表范围 */
+  bool is_full(int connfd) const;
+
+private:
+  void deal_with_accept();
+  void deal_with_read(int sockfd);
+  void deal_with_write(int sockfd);
+  void add_client(int connfd, const sockaddr_in &client_address);
+
+protected:
+  int m_id;
+  int m_listenfd;
+  int m_epollfd;
+  int m_signalfd;
+  int m_timerfd;
+  int m_wakeupfd;
+  std::atomic<bool> m_stop;
+  /* 工作线程交还的连接，命令保存在 http_conn::m_command 中 */
+  mpsc_queue<http_conn, &http_conn::m_next_command> m_mailbox;
+  /* 非阻塞数据库连接，为 NULL 表示语句由 sql_executor 执行 */
+  sql_async *m_sql;
+  /* 工作线程提交的语句，与命令一样通过 eventfd 唤醒 */
+  mpsc_queue<sql_request, &sql_request::next> m_sql_queue;
+  /* 上次回收连接表空页的时间 */
+  int64_t m_last_shrink;
+  epoll_event m_events[MAX_EVENT_NUMBER];
+
+  /* 所有事件循环共享按 fd 索引的连接表，每个 fd 只属于一个事件循环 */
+  conn_table *m_conns;
+  threadpool<http_conn> *m_pool;
+
+  /* 定时器非线程安全，每个事件循环各持有一个 */
+#ifdef TIMER_WHEEL
+  time_wheel m_timer_lst;
+#endif
+#ifdef TIMER_LIST
+  sort_timer_lst m_timer_lst;
+#endif
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include "uring.h"
+
+#ifdef USE_IO_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring::uring()
+    : m_ring_fd(-1), m_sqes(NULL), m_sqe_tail(0), m_sq_ptr(MAP_FAILED),
+      m_sq_size(0), m_cq_ptr(MAP_FAILED), m_cq_size(0), m_sqes_size(0),
+      m_buf_ring(NULL), m_buf_ring_size(0), m_bufs(NULL), m_buf_size(0),
+      m_buf_count(0) {}
+
+uring::~uring() {
+  if (m_bufs) {
+    free(m_bufs);
+  }
+  if (m_buf_ring) {
+    munmap(m_buf_ring, m_buf_ring_size);
+  }
+  if (m_sqes) {
+    munmap(m_sqes, m_sqes_size);
+  }
+  if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) {
+    munmap(m_cq_ptr, m_cq_size);
+  }
+  if (m_sq_ptr != MAP_FAILED) {
+    munmap(m_sq_ptr, m_sq_size);
+  }
+  if (m_ring_fd != -1) {
+    close(m_ring_fd);
+  }
+}
+
+bool uring::init(unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  m_ring_fd = io_uring_setup(entries, &p);
+  if (m_ring_fd < 0) {
+    return false;
+  }
+
+  m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  /* 新内核中SQ和CQ共用一次mmap */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (m_cq_size > m_sq_size) {
+      m_sq_size = m_cq_size;
+    }
+    m_cq_size = m_sq_size;
+  }
+
+  m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+  if (m_sq_ptr == MAP_FAILED) {
+    return false;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    m_cq_ptr = m_sq_ptr;
+  } else {
+    m_cq_ptr = mmap(0, m_cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+    if (m_cq_ptr == MAP_FAILED) {
+      return false;
+    }
+  }
+
+  m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(0, m_sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  m_sqes = (struct io_uring_sqe *)sqes;
+
+  char *sq = (char *)m_sq_ptr;
+  m_sq_head = (unsigned *)(sq + p.sq_off.head);
+  m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  m_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  m_sq_array = (unsigned *)(sq + p.sq_off.array);
+  m_sq_entries = p.sq_entries;
+  m_sqe_tail = *m_sq_tail;
+  /* SQ 数组与 sqes 一一对应，初始化一次即可 */
+  for (unsigned i = 0; i < m_sq_entries; ++i) {
+    m_sq_array[i] = i;
+  }
+
+  char *cq = (char *)m_cq_ptr;
+  m_cq_head = (unsigned *)(cq + p.cq_off.head);
+  m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  m_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return true;
+}
+
+bool uring::reserve(unsigned n) {
+  unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+  if (m_sqe_tail - head + n > m_sq_entries) {
+    /* 提交队列空间不够，先把已有请求交给内核 */
+    submit_and_wait(0);
+    head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sqe_tail - head + n > m_sq_entries) {
+      /* 内核暂时不接受提交(如完成队列溢出)，由调用者稍后重试 */
+      return false;
+    }
+  }
+  return true;
+}
+
+struct io_uring_sqe *uring::get_sqe() {
+  if (!reserve(1)) {
+    return NULL;
+  }
+  struct io_uring_sqe *sqe = &m_sqes[m_sqe_tail & *m_sq_mask];
+  ++m_sqe_tail;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring::submit_and_wait(unsigned wait_nr) {
+  /* 从内核尚未取走的位置(SQ头部)算起：之前失败或只提交了一部分的请求已经发布，
+   * 仍留在队列中，必须与新请求一起计入，否则之后每次都少提交这么多 */
+  unsigned to_submit =
+      m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+  /* 发布新的SQ尾部，内核看到tail之前必须先看到sqe的内容 */
+  __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  do {
+    ret = io_uring_enter(m_ring_fd, to_submit, wait_nr, flags);
+  } while (ret < 0 && errno == EINTR && wait_nr == 0);
+  return ret;
+}
+
+struct io_uring_cqe *uring::peek_cqe() {
+  unsigned head = *m_cq_head;
+  if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &m_cqes[head & *m_cq_mask];
+}
+
+void uring::cqe_seen() {
+  __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool uring::register_buf_ring(unsigned short bgid, unsigned count,
+                              int buf_size) {
+  m_buf_ring_size = count * sizeof(struct io_uring_buf);
+  void *ring = mmap(NULL, m_buf_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring == MAP_FAILED) {
+    return false;
+  }
+  m_buf_ring = (struct io_uring_buf_ring *)ring;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)ring;
+  reg.ring_entries = count;
+  reg.bgid = bgid;
+  if (io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return false;
+  }
+
+  m_bufs = (char *)malloc((size_t)count * buf_size);
+  if (!m_bufs) {
+    return false;
+  }
+  m_buf_size = buf_size;
+  m_buf_count = count;
+  m_buf_mask = count - 1;
+  m_buf_ring->tail = 0;
+  for (unsigned i = 0; i < count; ++i) {
+    recycle_buf((unsigned short)i);
+  }
+  return true;
+}
+
+void uring::recycle_buf(unsigned short bid) {
+  unsigned short tail = m_buf_ring->tail;
+  /* C++ 中 __DECLARE_FLEX_ARRAY 展开后 bufs 的偏移不为0，这里按数组首地址计算 */
+  struct io_uring_buf *buf =
+      (struct io_uring_buf *)m_buf_ring + (tail & m_buf_mask);
+  buf->addr = (unsigned long)get_buf(bid);
+  buf->len = m_buf_size;
+  buf->bid = bid;
+  __atomic_store_n(&m_buf_ring->tail, (unsigned short)(tail + 1),
+                   __ATOMIC_RELEASE);
+}
+
+#endif
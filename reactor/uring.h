@@ -0,0 +1,79 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* io_uring 的最小封装，直接使用系统调用，不依赖 liburing
+ * 提交队列(SQ)和完成队列(CQ)均由内核与用户态共享内存，
+ * 对 head/tail 的访问需要 acquire/release 语义
+ */
+class uring {
+
+public:
+  uring();
+  ~uring();
+
+  /* entries 为提交队列长度 */
+  bool init(unsigned entries);
+
+  /* 确保提交队列至少还有 n 个空闲项，不够时先提交，仍然不够时返回 false
+   * 链接(IOSQE_IO_LINK)的请求必须在同一次提交中，准备前先为整条链预留 */
+  bool reserve(unsigned n);
+  /* 获取一个空闲的提交队列项，队列已满时先提交再获取，仍然满时返回 NULL */
+  struct io_uring_sqe *get_sqe();
+  /* 提交所有待提交的请求，并至少等待 wait_nr 个完成事件
+   * 返回本次被内核取走的个数，少于待提交数(或出错)时其余的留在队列中，
+   * 下次调用时重新提交 */
+  int submit_and_wait(unsigned wait_nr);
+  /* 取出下一个完成事件，没有时返回 NULL */
+  struct io_uring_cqe *peek_cqe();
+  /* 标记完成事件已被处理 */
+  void cqe_seen();
+
+  /* 注册一组由内核挑选的接收缓冲区(provided buffer ring)，
+   * 每块 buf_size 字节，共 count 块，count 必须是2的幂 */
+  bool register_buf_ring(unsigned short bgid, unsigned count, int buf_size);
+  /* 获取第 bid 块接收缓冲区 */
+  char *get_buf(unsigned short bid) { return m_bufs + (size_t)bid * m_buf_size; }
+  /* 接收完毕，把第 bid 块缓冲区还给内核 */
+  void recycle_buf(unsigned short bid);
+
+private:
+  int m_ring_fd;
+
+  /* 提交队列 */
+  unsigned *m_sq_head;
+  unsigned *m_sq_tail;
+  unsigned *m_sq_mask;
+  unsigned *m_sq_array;
+  struct io_uring_sqe *m_sqes;
+  unsigned m_sqe_tail; /* 已获取但尚未提交的位置 */
+  unsigned m_sq_entries;
+
+  /* 完成队列 */
+  unsigned *m_cq_head;
+  unsigned *m_cq_tail;
+  unsigned *m_cq_mask;
+  struct io_uring_cqe *m_cqes;
+
+  void *m_sq_ptr;
+  size_t m_sq_size;
+  void *m_cq_ptr;
+  size_t m_cq_size;
+  size_t m_sqes_size;
+
+  /* 接收缓冲区环 */
+  struct io_uring_buf_ring *m_buf_ring;
+  size_t m_buf_ring_size;
+  unsigned m_buf_mask;
+  char *m_bufs;
+  int m_buf_size;
+  unsigned m_buf_count;
+};
+
+#endif
+
+#endif
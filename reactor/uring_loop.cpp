@@ -0,0 +1,443 @@
+#include "uring_loop.h"
+
+#ifdef USE_IO_URING
+
+#include "../log/log.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* user_data 的高32位为操作类型，低32位为描述符 */
+static inline __u64 make_data(int op, int fd) {
+  return ((__u64)op << 32) | (unsigned)fd;
+}
+
+//定时器回调函数，只关闭连接的读写，未完成的 recv/send 随即返回，
+//由事件循环在完成事件中统一关闭描述符，避免描述符被复用后收到旧的完成事件
+static void uring_cb_func(client_data *user_data) {
+  user_data->timer = NULL;
+  if (user_data->busy) {
+    /* 连接在工作线程中，没有未完成的I/O，等工作线程交还后再关闭 */
+    user_data->expired = true;
+    return;
+  }
+  shutdown(user_data->sockfd, SHUT_RDWR);
+  LOG_INFO("shutdown fd %d", user_data->sockfd);
+  Log::get_instance()->flush();
+}
+
+uring_loop::uring_loop(int id, threadpool<http_conn> *pool)
+    : event_loop(id, pool), m_send(NULL) {}
+
+uring_loop::~uring_loop() { free(m_send); }
+
+bool uring_loop::init(const char *ip, int port, bool reuseport,
+                      int signalfd) {
+  if (!open_listen(ip, port, reuseport)) {
+    return false;
+  }
+  m_signalfd = signalfd;
+  if (!m_ring.init(URING_ENTRIES)) {
+    LOG_ERROR("%s:errno is:%d", "io_uring_setup error", errno);
+    return false;
+  }
+  if (!m_ring.register_buf_ring(URING_BUF_GROUP, URING_BUF_COUNT,
+                                http_conn::READ_BUFFER_SIZE)) {
+    LOG_ERROR("%s:errno is:%d", "register buffer ring error", errno);
+    return false;
+  }
+  /* calloc 得到的大块内存由内核按需分配清零的物理页，只有用到的描述符占用内存 */
+  m_send = (send_state *)calloc(m_conns->max_fd(), sizeof(send_state));
+  if (!m_send) {
+    return false;
+  }
+
+  arm(OP_ACCEPT, m_listenfd);
+  arm(OP_TIMER, m_timerfd);
+  arm(OP_WAKEUP, m_wakeupfd);
+  if (m_signalfd != -1) {
+    arm(OP_SIGNAL, m_signalfd);
+  }
+  return true;
+}
+
+bool uring_loop::prep_accept() {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = m_listenfd;
+  /* 一次提交持续接受新连接，客户地址之后通过 getpeername 获取 */
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = make_data(OP_ACCEPT, m_listenfd);
+  return true;
+}
+
+bool uring_loop::prep_recv(int fd) {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->len = http_conn::READ_BUFFER_SIZE;
+  /* 不指定接收地址，由内核从缓冲区组中挑选，空闲连接不占用接收缓冲区 */
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = make_data(OP_RECV, fd);
+  return true;
+}
+
+bool uring_loop::prep_send(int fd) {
+  int count = 0;
+  struct iovec *iov = m_conns->conn(fd)->get_iov(&count);
+
+  /* 找出最后一个非空的内存块，链上之前的 send 都带 MSG_MORE */
+  int last = -1;
+  unsigned chain = 0;
+  for (int i = 0; i < count; ++i) {
+    if (iov[i].iov_len > 0) {
+      last = i;
+      ++chain;
+    }
+  }
+  if (last == -1) {
+    /* 没有需要发送的数据，与 http_conn::write() 一样重新开始读 */
+    m_send[fd].done = true;
+    m_send[fd].pending = 0;
+    if (m_conns->conn(fd)->finish_write()) {
+      start_next(fd);
+    } else {
+      close_client(fd);
+    }
+    return true;
+  }
+
+  /* 整条链在同一次提交中，中途不能因为队列满而先提交前一半 */
+  if (!m_ring.reserve(chain)) {
+    return false;
+  }
+  m_send[fd].pending = 0;
+  m_send[fd].error = false;
+  m_send[fd].done = false;
+  for (int i = 0; i <= last; ++i) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    struct io_uring_sqe *sqe = m_ring.get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iov[i].iov_base;
+    sqe->len = iov[i].iov_len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    if (i != last) {
+      /* 前一个 send 未完整发送时内核会取消后一个 */
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->msg_flags |= MSG_MORE;
+    }
+    sqe->user_data = make_data(OP_SEND, fd);
+    ++m_send[fd].pending;
+  }
+  return true;
+}
+
+bool uring_loop::prep_poll(int fd, OP_TYPE op) {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = make_data(op, fd);
+  return true;
+}
+
+bool uring_loop::prep_watch(int fd, int events) {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  if (events == 0) {
+    /* 连接断开，撤销可能还未完成的 poll */
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = make_data(OP_SQL, fd);
+    sqe->user_data = make_data(OP_SQL_REMOVE, fd);
+    return true;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = 0;
+  if (events & SQL_WAIT_READ) {
+    sqe->poll32_events |= POLLIN;
+  }
+  if (events & SQL_WAIT_WRITE) {
+    sqe->poll32_events |= POLLOUT;
+  }
+  sqe->user_data = make_data(OP_SQL, fd);
+  return true;
+}
+
+void uring_loop::watch(int fd, int events) { arm(OP_SQL, fd, events); }
+
+void uring_loop::arm(OP_TYPE op, int fd, int events) {
+  bool ok;
+  if (op == OP_ACCEPT) {
+    ok = prep_accept();
+  } else if (op == OP_SQL) {
+    ok = prep_watch(fd, events);
+  } else {
+    ok = prep_poll(fd, op);
+  }
+  if (!ok) {
+    deferred_op d;
+    d.op = op;
+    d.fd = fd;
+    d.events = events;
+    m_deferred.push_back(d);
+  }
+}
+
+void uring_loop::retry_deferred() {
+  std::vector<deferred_op> ops;
+  ops.swap(m_deferred);
+  /* 按原来的顺序重试，同一个数据库连接的撤销和重新监听不会颠倒 */
+  for (size_t i = 0; i < ops.size(); ++i) {
+    arm(ops[i].op, ops[i].fd, ops[i].events);
+  }
+}
+
+void uring_loop::on_accept(int res, unsigned flags) {
+  /* multishot accept 出错或被内核终止时需要重新提交 */
+  if (!(flags & IORING_CQE_F_MORE)) {
+    arm(OP_ACCEPT, m_listenfd);
+  }
+  if (res < 0) {
+    LOG_ERROR("%s:errno is:%d", "accept error", -res);
+    return;
+  }
+  int connfd = res;
+  if (is_full(connfd)) {
+    show_error(connfd, "Internal server busy");
+    LOG_ERROR("%s", "Internal server busy");
+    return;
+  }
+
+  struct sockaddr_in client_address;
+  socklen_t client_addrlength = sizeof(client_address);
+  memset(&client_address, 0, sizeof(client_address));
+  getpeername(connfd, (struct sockaddr *)&client_address, &client_addrlength);
+
+  m_conns->acquire(connfd)->init(connfd, client_address, -1, this);
+
+  client_data *user_data = m_conns->data(connfd);
+  user_data->address = client_address;
+  user_data->sockfd = connfd;
+  user_data->epollfd = -1;
+  util_timer *timer = &user_data->timer_node;
+  timer->user_data = user_data;
+  timer->cb_func = uring_cb_func;
+  /* 新连接从接受起就要在期限内发送完请求头 */
+  timer->expire = monotonic_ms() + HEADER_TIMEOUT;
+  user_data->timer = timer;
+  user_data->phase = PHASE_HEADER;
+  user_data->busy = false;
+  user_data->expired = false;
+  m_timer_lst.add_timer(timer);
+
+  if (!prep_recv(connfd)) {
+    close_client(connfd);
+  }
+}
+
+void uring_loop::on_recv(int fd, int res, unsigned flags) {
+  bool ok = false;
+  if (flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0) {
+      ok = m_conns->conn(fd)->append_read(m_ring.get_buf(bid), res);
+    }
+    m_ring.recycle_buf(bid);
+  } else if (res == -ENOBUFS) {
+    /* 接收缓冲区暂时用完，重新提交等待归还 */
+    if (!prep_recv(fd)) {
+      close_client(fd);
+    }
+    return;
+  }
+
+  if (!ok) {
+    close_client(fd);
+    return;
+  }
+
+  LOG_INFO("deal with the client(%s)",
+           inet_ntoa(m_conns->conn(fd)->get_address()->sin_addr));
+  Log::get_instance()->flush();
+
+  /* 按连接所处的阶段调整定时器，交给线程池之后不能再访问连接的解析状态 */
+  update_read_phase(fd);
+  dispatch(fd);
+}
+
+void uring_loop::on_send(int fd, int res) {
+  send_state &st = m_send[fd];
+  --st.pending;
+  if (res > 0) {
+    if (m_conns->conn(fd)->advance_write(res)) {
+      st.done = true;
+    }
+  } else if (res != -ECANCELED) {
+    st.error = true;
+  }
+  if (st.pending > 0) {
+    return;
+  }
+
+  if (st.error) {
+    m_conns->conn(fd)->finish_write();
+    close_client(fd);
+    return;
+  }
+  if (!st.done) {
+    /* 部分发送，从更新后的位置继续 */
+    update_write_phase(fd);
+    if (!prep_send(fd)) {
+      m_conns->conn(fd)->finish_write();
+      close_client(fd);
+    }
+    return;
+  }
+
+  LOG_INFO("send data to the client(%s)",
+           inet_ntoa(m_conns->conn(fd)->get_address()->sin_addr));
+  Log::get_instance()->flush();
+
+  if (m_conns->conn(fd)->finish_write()) {
+    start_next(fd);
+  } else {
+    close_client(fd);
+  }
+}
+
+void uring_loop::start_next(int fd) {
+  update_write_phase(fd);
+  /* 读缓冲中还有流水线请求时直接交给线程池，否则继续接收 */
+  if (m_conns->conn(fd)->has_pending_request()) {
+    dispatch(fd);
+  } else if (!prep_recv(fd)) {
+    close_client(fd);
+  }
+}
+
+void uring_loop::resume(int fd, int ev) {
+  if (ev == EPOLLIN) {
+    if (!prep_recv(fd)) {
+      close_client(fd);
+    }
+  } else if (!prep_send(fd)) {
+    m_conns->conn(fd)->finish_write();
+    close_client(fd);
+  }
+}
+
+void uring_loop::close_client(int fd) {
+  util_timer *timer = m_conns->data(fd)->timer;
+  if (timer) {
+    m_timer_lst.del_timer(timer);
+    m_conns->data(fd)->timer = NULL;
+  }
+  /* 先归还缓冲再关闭，关闭后同一个描述符可能立即被其他反应堆复用 */
+  m_conns->conn(fd)->release_buffers();
+  ::close(fd);
+  http_conn::m_user_count--;
+  LOG_INFO("close fd %d", fd);
+  Log::get_instance()->flush();
+  m_conns->release(fd);
+}
+
+void uring_loop::loop() {
+  bool timeout = false;
+  bool stop_loop = false;
+
+  LOG_INFO("io_uring event loop %d start", m_id);
+  Log::get_instance()->flush();
+
+  while (!stop_loop) {
+    retry_deferred();
+    int ret = m_ring.submit_and_wait(1);
+    /* EBUSY/EAGAIN: 完成队列积压或内核暂时无法分配，先处理完成事件再提交；
+     * 出错或只提交了一部分时，其余请求留在队列中，下一轮与新请求一起提交 */
+    if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+      LOG_ERROR("%s:errno is:%d", "io_uring_enter failure", errno);
+      break;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = m_ring.peek_cqe()) != NULL) {
+      int op = (int)(cqe->user_data >> 32);
+      int fd = (int)(cqe->user_data & 0xffffffff);
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      m_ring.cqe_seen();
+
+      switch (op) {
+      case OP_ACCEPT: {
+        on_accept(res, flags);
+        break;
+      }
+      case OP_RECV: {
+        on_recv(fd, res, flags);
+        break;
+      }
+      case OP_SEND: {
+        on_send(fd, res);
+        break;
+      }
+      case OP_SIGNAL: {
+        //处理信号
+        deal_with_signal(stop_loop);
+        arm(OP_SIGNAL, m_signalfd);
+        break;
+      }
+      case OP_TIMER: {
+        timeout = true;
+        arm(OP_TIMER, m_timerfd);
+        break;
+      }
+      case OP_WAKEUP: {
+        deal_with_wakeup(stop_loop);
+        arm(OP_WAKEUP, m_wakeupfd);
+        break;
+      }
+      case OP_SQL: {
+        /* 出错或挂断时让客户端库在继续执行时发现 */
+        int ready = 0;
+        if (res < 0 || (res & (POLLIN | POLLHUP | POLLERR))) {
+          ready |= SQL_WAIT_READ;
+        }
+        if (res < 0 || (res & (POLLOUT | POLLHUP | POLLERR))) {
+          ready |= SQL_WAIT_WRITE;
+        }
+        m_sql->on_event(fd, ready);
+        break;
+      }
+      }
+    }
+    if (timeout) {
+      deal_with_timer();
+      timeout = false;
+    }
+  }
+
+  LOG_INFO("io_uring event loop %d stop", m_id);
+  Log::get_instance()->flush();
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#ifdef USE_IO_URING
+
+#include <vector>
+
+#include "event_loop.h"
+#include "uring.h"
+
+#define URING_ENTRIES 4096    // 提交队列长度
+#define URING_BUF_COUNT 1024  // 接收缓冲区块数，必须是2的幂
+#define URING_BUF_GROUP 0     // 接收缓冲区组号
+
+/* 基于 io_uring 的事件循环
+ * 与 event_loop 共用监听socket、timerfd、eventfd 和定时器，驱动同一个 http_conn 状态机：
+ *   multishot accept 接受新连接
+ *   recv 由内核从 provided buffer ring 中挑选接收缓冲区
+ *   应答头和文件内容用链接(IOSQE_IO_LINK)的两个 send 一次提交
+ * 每个连接同一时刻最多只有一个未完成的I/O(或正在被工作线程处理)，
+ * 与 epoll 后端的 EPOLLONESHOT 语义相同。
+ */
+class uring_loop : public event_loop {
+
+public:
+  uring_loop(int id, threadpool<http_conn> *pool);
+  ~uring_loop();
+
+  bool init(const char *ip, int port, bool reuseport, int signalfd = -1);
+  void loop();
+
+private:
+  enum OP_TYPE {
+    OP_ACCEPT = 0,
+    OP_RECV,
+    OP_SEND,
+    OP_SIGNAL,
+    OP_TIMER,
+    OP_WAKEUP,
+    OP_SQL,       /* 非阻塞数据库连接的 poll */
+    OP_SQL_REMOVE /* 撤销上面的 poll，完成事件直接忽略 */
+  };
+
+  /* 连接上未完成的 send 链 */
+  struct send_state {
+    int pending; /* 尚未完成的 send 数量 */
+    bool error;  /* 链上有 send 失败 */
+    bool done;   /* 应答已全部发送 */
+  };
+
+  /* 提交队列满而没能提交的 accept、poll 和数据库连接的 poll，下一轮提交前重试 */
+  struct deferred_op {
+    OP_TYPE op;
+    int fd;
+    int events; /* 只用于 OP_SQL */
+  };
+
+  /* 以下函数在提交队列满、提交后仍没有空闲项时返回 false，
+   * recv/send 失败时由调用者关闭连接，其余的交给 arm() 稍后重试 */
+  bool prep_accept();
+  bool prep_recv(int fd);
+  bool prep_send(int fd);
+  bool prep_poll(int fd, OP_TYPE op);
+  bool prep_watch(int fd, int events);
+  /* 提交 accept 或 poll，提交队列满时放入 m_deferred */
+  void arm(OP_TYPE op, int fd, int events = 0);
+  /* 重试 m_deferred 中的操作 */
+  void retry_deferred();
+
+  void on_accept(int res, unsigned flags);
+  void on_recv(int fd, int res, unsigned flags);
+  void on_send(int fd, int res);
+
+  /* 应答发送完毕且保持连接时，处理下一个请求 */
+  void start_next(int fd);
+
+  /* 工作线程交还连接后提交 recv 或 send */
+  void resume(int fd, int ev);
+  /* 只在连接上没有未完成的I/O时调用 */
+  void close_client(int fd);
+  /* 为数据库连接提交一次性的 poll */
+  void watch(int fd, int events);
+
+private:
+  uring m_ring;
+  send_state *m_send;
+  std::vector<deferred_op> m_deferred;
+};
+
+#endif
+
+#endif
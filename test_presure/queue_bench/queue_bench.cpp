@@ -0,0 +1,211 @@
+/* 线程池请求队列的基准测试
+ * 比较原来的 std::list + 互斥锁 + 信号量 与现在的无锁有界环形队列 + 空闲休眠，
+ * P 个生产者各放入 N 个任务，C 个消费者取出，统计每秒处理的任务数。
+ * 队列满时生产者让出CPU后重试。
+ *
+ * 编译: make
+ * 运行: ./queue_bench [每个生产者的任务数]
+ */
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../lock/locker.h"
+#include "../../lock/mpmc_queue.h"
+
+struct task {
+  long value;
+};
+
+/* 原来的请求队列：每次放入和取出都加同一把锁，每个任务一次 sem_post/sem_wait */
+class list_queue {
+public:
+  explicit list_queue(int max_requests) : m_max_requests(max_requests) {}
+
+  bool push(task *t) {
+    m_lock.lock();
+    if ((int)m_queue.size() >= m_max_requests) {
+      m_lock.unlock();
+      return false;
+    }
+    m_queue.push_back(t);
+    m_lock.unlock();
+    m_stat.post();
+    return true;
+  }
+  task *pop() {
+    m_stat.wait();
+    m_lock.lock();
+    if (m_queue.empty()) {
+      m_lock.unlock();
+      return NULL;
+    }
+    task *t = m_queue.front();
+    m_queue.pop_front();
+    m_lock.unlock();
+    return t;
+  }
+  void wake_all(int n) {
+    for (int i = 0; i < n; ++i) {
+      m_stat.post();
+    }
+  }
+
+private:
+  int m_max_requests;
+  std::list<task *> m_queue;
+  locker m_lock;
+  sem m_stat;
+};
+
+/* 现在的请求队列：无锁环形队列，只在有消费者休眠时才唤醒，与 threadpool 相同 */
+class ring_queue {
+public:
+  explicit ring_queue(int max_requests)
+      : m_queue(max_requests), m_idle(0), m_stop(false) {}
+
+  bool push(task *t) {
+    if (!m_queue.push(t)) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_idle.load(std::memory_order_relaxed) > 0) {
+      m_lock.lock();
+      m_cond.signal();
+      m_lock.unlock();
+    }
+    return true;
+  }
+  task *pop() {
+    task *t = m_queue.pop();
+    if (t) {
+      return t;
+    }
+    m_lock.lock();
+    m_idle.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!m_stop && m_queue.size() == 0) {
+      m_cond.wait(m_lock.get());
+    }
+    m_idle.fetch_sub(1, std::memory_order_relaxed);
+    m_lock.unlock();
+    return NULL;
+  }
+  void wake_all(int n) {
+    m_lock.lock();
+    m_stop = true;
+    m_cond.broadcast();
+    m_lock.unlock();
+  }
+
+private:
+  mpmc_queue<task> m_queue;
+  locker m_lock;
+  cond m_cond;
+  std::atomic<int> m_idle;
+  bool m_stop;
+};
+
+template <typename Q> struct bench {
+  Q *queue;
+  task *tasks;
+  long per_producer;
+  long total;
+  std::atomic<long> consumed;
+  std::atomic<long> sum;
+
+  static void *producer(void *arg) {
+    std::pair<bench *, int> *p = (std::pair<bench *, int> *)arg;
+    bench *b = p->first;
+    task *base = b->tasks + p->second * b->per_producer;
+    for (long i = 0; i < b->per_producer; ++i) {
+      while (!b->queue->push(base + i)) {
+        sched_yield();
+      }
+    }
+    return NULL;
+  }
+  static void *consumer(void *arg) {
+    bench *b = (bench *)arg;
+    long sum = 0;
+    while (b->consumed.load(std::memory_order_relaxed) < b->total) {
+      task *t = b->queue->pop();
+      if (t) {
+        sum += t->value;
+        b->consumed.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    b->sum.fetch_add(sum);
+    return NULL;
+  }
+
+  /* 返回每秒处理的任务数 */
+  double run(int producers, int consumers, long n) {
+    Q q(10000);
+    queue = &q;
+    per_producer = n;
+    total = producers * n;
+    consumed = 0;
+    sum = 0;
+    tasks = new task[total];
+    for (long i = 0; i < total; ++i) {
+      tasks[i].value = i;
+    }
+
+    pthread_t *threads = new pthread_t[producers + consumers];
+    std::pair<bench *, int> *args = new std::pair<bench *, int>[producers];
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (int i = 0; i < consumers; ++i) {
+      pthread_create(threads + i, NULL, consumer, this);
+    }
+    for (int i = 0; i < producers; ++i) {
+      args[i] = std::make_pair(this, i);
+      pthread_create(threads + consumers + i, NULL, producer, args + i);
+    }
+    for (int i = 0; i < producers; ++i) {
+      pthread_join(threads[consumers + i], NULL);
+    }
+    while (consumed.load() < total) {
+      sched_yield();
+    }
+    /* 唤醒还在等待的消费者让它们退出 */
+    q.wake_all(consumers);
+    for (int i = 0; i < consumers; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    if (sum.load() != total * (total - 1) / 2) {
+      printf("checksum mismatch\n");
+      exit(1);
+    }
+    delete[] args;
+    delete[] threads;
+    delete[] tasks;
+    return total / seconds;
+  }
+};
+
+int main(int argc, char *argv[]) {
+  long n = argc > 1 ? atol(argv[1]) : 200000;
+  int configs[] = {1, 4, 16};
+
+  printf("%-22s %16s %16s\n", "producers/consumers", "list+sem ops/s",
+         "mpmc ring ops/s");
+  for (int i = 0; i < 3; ++i) {
+    int threads = configs[i];
+    bench<list_queue> old_bench;
+    bench<ring_queue> new_bench;
+    double old_rate = old_bench.run(threads, threads, n);
+    double new_rate = new_bench.run(threads, threads, n);
+    printf("%10d/%-11d %16.0f %16.0f\n", threads, threads, old_rate, new_rate);
+  }
+  return 0;
+}
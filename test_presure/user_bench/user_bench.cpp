@@ -0,0 +1,148 @@
+/* 用户表查找的基准测试
+ * 比较原来的 std::map + 全局锁(查找也加锁，否则与注册并发时是数据竞争)
+ * 与现在的分片开放寻址表(查找不加锁)。预先放入 U 个用户，
+ * T 个线程各做 N 次登录校验，其中一个线程每 INSERT_EVERY 次查找注册一个新用户，
+ * 统计每秒的查找次数。
+ *
+ * 编译: make
+ * 运行: ./user_bench [每个线程的查找次数] [预先放入的用户数]
+ */
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "../../http/user_table.h"
+#include "../../lock/locker.h"
+
+/* 原来的用户表：红黑树，注册和登录都持有同一把锁 */
+class map_users {
+public:
+  bool check(const char *name, const char *password) {
+    m_lock.lock();
+    std::map<std::string, std::string>::iterator it = m_users.find(name);
+    bool ok = it != m_users.end() && it->second == password;
+    m_lock.unlock();
+    return ok;
+  }
+  bool insert(const char *name, const char *password) {
+    m_lock.lock();
+    bool ok = m_users.insert(std::make_pair(std::string(name),
+                                            std::string(password)))
+                  .second;
+    m_lock.unlock();
+    return ok;
+  }
+
+private:
+  std::map<std::string, std::string> m_users;
+  locker m_lock;
+};
+
+/* 现在的用户表，user_table 是单例，各轮测试使用不同的用户名前缀 */
+class table_users {
+public:
+  bool check(const char *name, const char *password) {
+    return user_table::get_instance()->check(name, password);
+  }
+  bool insert(const char *name, const char *password) {
+    return user_table::get_instance()->insert(name, password);
+  }
+};
+
+static const int INSERT_EVERY = 1000;
+
+template <typename U> struct bench {
+  U *users;
+  std::vector<std::string> names;
+  long per_thread;
+  int round;
+  std::atomic<long> hits;
+
+  struct arg {
+    bench *b;
+    int id;
+  };
+
+  static void *worker(void *p) {
+    arg *a = (arg *)p;
+    bench *b = a->b;
+    unsigned seed = a->id * 7919 + 1;
+    long hits = 0;
+    char name[64];
+    for (long i = 0; i < b->per_thread; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const std::string &user = b->names[(seed >> 8) % b->names.size()];
+      if (b->users->check(user.c_str(), "password")) {
+        ++hits;
+      }
+      if (a->id == 0 && i % INSERT_EVERY == 0) {
+        snprintf(name, sizeof(name), "new%d_%ld", b->round, i);
+        b->users->insert(name, "password");
+      }
+    }
+    b->hits.fetch_add(hits);
+    return NULL;
+  }
+
+  /* 返回每秒的查找次数 */
+  double run(U *u, int threads, long n, int user_number, int r) {
+    users = u;
+    per_thread = n;
+    round = r;
+    hits = 0;
+    names.clear();
+    char name[64];
+    for (int i = 0; i < user_number; ++i) {
+      snprintf(name, sizeof(name), "user%d_%d", r, i);
+      names.push_back(name);
+      users->insert(name, "password");
+    }
+
+    std::vector<pthread_t> tids(threads);
+    std::vector<arg> args(threads);
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; ++i) {
+      args[i].b = this;
+      args[i].id = i;
+      pthread_create(&tids[i], NULL, worker, &args[i]);
+    }
+    for (int i = 0; i < threads; ++i) {
+      pthread_join(tids[i], NULL);
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    if (hits.load() != threads * n) {
+      printf("lookup mismatch\n");
+      exit(1);
+    }
+    return threads * n / seconds;
+  }
+};
+
+int main(int argc, char *argv[]) {
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  int user_number = argc > 2 ? atoi(argv[2]) : 100000;
+  int configs[] = {1, 4, 16, 32};
+
+  printf("%-8s %18s %18s\n", "threads", "map+lock lookups/s",
+         "user_table lookups/s");
+  for (int i = 0; i < 4; ++i) {
+    int threads = configs[i];
+    map_users old_users;
+    table_users new_users;
+    bench<map_users> old_bench;
+    bench<table_users> new_bench;
+    double old_rate = old_bench.run(&old_users, threads, n, user_number, i);
+    double new_rate = new_bench.run(&new_users, threads, n, user_number, i);
+    printf("%-8d %18.0f %18.0f\n", threads, old_rate, new_rate);
+  }
+  return 0;
+}
@@ -1,124 +1,498 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
+#include <atomic>
 #include <cstdio>
 #include <exception>
-#include <list>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 /* 使用线程同步机制包装类 */
-#include "../CGImysql/sql_connection_pool.h"
 #include "../lock/locker.h"
+#include "../lock/mpmc_queue.h"
+#include "../lock/steal_deque.h"
 
-/* 线程池类 */
+/* 线程池类
+ * 工作窃取调度：每个工作线程有自己的 Chase-Lev 双端队列，事件循环把任务放入
+ * 共享的全局队列。工作线程按以下顺序取任务：
+ *   自己的队列 -> 全局队列(一次取走一批，多出的放入自己的队列) -> 窃取其他线程的队列
+ * 全局队列是按 max_requests 分配的无锁环形队列，放入和取出任务都不加锁，
+ * 也不为每个任务申请链表节点，队列满时 append 返回 false，由调用者处理过载。
+ * 找不到任务的线程在条件变量上休眠，只在有线程休眠时才唤醒，平时放入任务没有系统调用。
+ *
+ * 线程数在 [min_threads, max_threads] 之间伸缩：
+ *   全局队列中的任务附带入队时间，没有空闲线程且排队时间超过 QUEUE_WAIT_TARGET 时
+ *   增加一个线程(每 GROW_INTERVAL 最多一个)，线程阻塞在数据库上时静态请求不必一直排队；
+ *   休眠超过 WORKER_IDLE_TIMEOUT 的线程在多于 min_threads 时退出。
+ * 所有线程都可以 join，退出的线程在它的位置被复用或线程池析构时回收。
+ *
+ * 任务按 T::classify() 的结果分类，每个类别有自己的全局队列，数值越小优先级越高：
+ *   类别0(静态文件)批量取出、可以被窃取；其余类别每次取一个，并受 set_class_limit
+ *   设置的并发数限制，而且合计不能占满所有线程，总给类别0留下一个，
+ *   数据库请求再多也只占用有限的线程，静态请求的延迟不受影响；
+ *   每个线程每 LOWER_CLASS_INTERVAL 次取任务先看一次低优先级的队列，它们不会被饿死。
+ * 某个类别的任务因为线程不够(而不是达到自己的并发限制)排队过久时增加线程。
+ */
 template <typename T> class threadpool {
 
 public:
-  /* 参数thread_number
-   * 表示线程中线程数量，max_requests是请求队列中最多允许的、等待处理请求数量 */
-  threadpool(connection_pool *connPool, int thread_number = 8,
+  /* min_threads 和 max_threads 是线程数的上下限，
+   * max_requests是请求队列中最多允许的、等待处理请求数量 */
+  threadpool(int min_threads = 2, int max_threads = 32,
              int max_requests = 10000);
   ~threadpool();
 
-  /* 往请求队列中添加任务 */
+  /* 往请求队列中添加任务，由工作线程调用时放入自己的队列
+   * 队列已满时返回 false，任务没有放入，调用者需要拒绝或稍后重试 */
   bool append(T *request);
+  /* 限制同时处理的某类任务数，类别0不受限制，应在添加任务之前调用 */
+  void set_class_limit(int request_class, int limit);
 
 private:
-  /* 工作线程运行的函数，它不断从工作队列中取出任务执行 */
+  /* 每个工作线程的队列容量，必须是2的幂 */
+  static const int DEQUE_SIZE = 256;
+  /* 一次从全局队列取走的最大任务数 */
+  static const int MAX_BATCH = 32;
+  /* 任务排队超过该时间(微秒)且没有空闲线程时增加线程 */
+  static const int64_t QUEUE_WAIT_TARGET = 10000;
+  /* 两次增加线程的最小间隔(微秒) */
+  static const int64_t GROW_INTERVAL = 10000;
+  /* 线程空闲超过该时间(秒)后退出 */
+  static const int WORKER_IDLE_TIMEOUT = 30;
+  /* 每隔多少次取任务先检查一次低优先级的队列 */
+  static const unsigned LOWER_CLASS_INTERVAL = 4;
+  static const int CLASS_NUMBER = T::REQUEST_CLASS_NUMBER;
+
+  enum SLOT_STATE {
+    SLOT_FREE = 0, /* 没有线程 */
+    SLOT_RUNNING,  /* 线程在运行 */
+    SLOT_RETIRED   /* 线程已退出，尚未 join */
+  };
+
+  struct worker_slot {
+    threadpool *pool;
+    int index;
+    int state; /* SLOT_STATE，持有 m_growlocker 时修改 */
+    unsigned picks; /* 取任务的次数 */
+    steal_deque<T, DEQUE_SIZE> tasks; /* 只存放类别0的任务 */
+  };
+
+  /* 工作线程运行的函数，它不断取出任务执行 */
   static void *worker(void *arg);
-  void run();
+  void run(worker_slot *self);
+  /* 取一个任务，request_class 返回它的类别 */
+  T *take(worker_slot *self, int *request_class);
+  T *take_injected(worker_slot *self);
+  T *steal(worker_slot *self);
+  /* 从低优先级的队列中取一个不超过并发限制的任务 */
+  T *take_lower(int *request_class);
+  /* 低优先级的类别是否有任务且还能再处理一个 */
+  bool class_ready(int request_class);
+  /* 占用和归还低优先级类别的并发名额 */
+  bool reserve(int request_class);
+  void release(int request_class);
+  /* 所有线程都在忙时检查各类别队首任务的排队时间 */
+  void check_wait(int64_t now);
+  /* 是否还有任务，休眠前检查 */
+  bool has_task();
+  /* 休眠到有新任务，空闲超时返回 false */
+  bool park();
+  /* 放入新任务之后调用，有休眠的线程时唤醒一个 */
+  void notify();
+  /* 任务已经排队 wait 微秒，需要时增加一个线程 */
+  void maybe_grow(int64_t wait, int64_t now);
+  /* 在空闲的位置上创建线程，调用时持有 m_growlocker */
+  bool spawn();
+  /* 空闲超时的线程尝试退出，线程数不能少于 m_min_threads */
+  bool retire(worker_slot *self);
+  static int64_t now_us();
 
 private:
-  int m_thread_number;  /* 线程池中的线程数 */
-  int m_max_requests;   /* 请求队列中允许的最大请求数 */
-  pthread_t *m_threads; /* 描述线程池数组，大小为m_thread_number */
-  std::list<T *> m_workqueue; /* 请求队列 */
-  locker m_queuelocker;       /* 保护请求队列的互斥锁 */
-  sem m_queuestat;            /* 是否有任务需要处理 */
-  bool m_stop;                /* 结束进程 */
-
-  connection_pool *m_connPool; //数据库
+  int m_min_threads;      /* 线程数下限 */
+  int m_max_threads;      /* 线程数上限 */
+  int m_max_requests;     /* 全局队列中允许的最大请求数 */
+  pthread_t *m_threads;   /* 描述线程池数组，大小为m_max_threads */
+  worker_slot *m_slots;   /* 每个线程的队列，大小为m_max_threads */
+  /* 每个类别的全局队列，容量为m_max_requests向上取整为2的幂 */
+  mpmc_queue<T> *m_workqueue[CLASS_NUMBER];
+  int m_class_limit[CLASS_NUMBER];                /* 每个类别的并发限制 */
+  std::atomic<int> m_class_running[CLASS_NUMBER]; /* 每个类别正在处理的任务数 */
+  std::atomic<int> m_lower_running; /* 类别0以外正在处理的任务总数 */
+  locker m_parklocker;           /* 休眠和唤醒使用的互斥锁 */
+  cond m_parkcond;               /* 休眠的线程在其上等待 */
+  std::atomic<int> m_idle;       /* 休眠的线程数 */
+  locker m_growlocker;           /* 创建和退出线程时使用的互斥锁 */
+  std::atomic<int> m_active;     /* 运行中的线程数 */
+  std::atomic<int64_t> m_last_grow; /* 上次增加线程的时间(微秒) */
+  std::atomic<bool> m_stop;      /* 结束进程 */
+
+  /* 当前线程所属的工作线程，不是工作线程时为 NULL */
+  static thread_local worker_slot *m_current;
 };
 
 template <typename T>
-threadpool<T>::threadpool(connection_pool *connPool, int thread_number,
-                          int max_requests)
-    : m_thread_number(thread_number), m_max_requests(max_requests),
-      m_stop(false), m_threads(NULL), m_connPool(connPool) {
-  if ((thread_number <= 0) || (max_requests <= 0)) {
+thread_local typename threadpool<T>::worker_slot *threadpool<T>::m_current =
+    NULL;
+
+template <typename T>
+threadpool<T>::threadpool(int min_threads, int max_threads, int max_requests)
+    : m_min_threads(min_threads), m_max_threads(max_threads),
+      m_max_requests(max_requests), m_threads(NULL), m_slots(NULL),
+      m_lower_running(0), m_idle(0), m_active(0), m_last_grow(0),
+      m_stop(false) {
+  static_assert(MAX_BATCH <= DEQUE_SIZE, "batch must fit in a worker deque");
+  if ((min_threads <= 0) || (max_threads < min_threads) ||
+      (max_requests <= 0)) {
     throw std::exception();
   }
+  for (int i = 0; i < CLASS_NUMBER; ++i) {
+    m_workqueue[i] = new mpmc_queue<T>(max_requests);
+    m_class_limit[i] = max_threads;
+    m_class_running[i] = 0;
+  }
 
-  m_threads = new pthread_t[m_thread_number];
-  if (!m_threads) {
-    throw std::exception();
+  m_threads = new pthread_t[m_max_threads];
+  m_slots = new worker_slot[m_max_threads];
+  for (int i = 0; i < m_max_threads; ++i) {
+    m_slots[i].pool = this;
+    m_slots[i].index = i;
+    m_slots[i].state = SLOT_FREE;
+    m_slots[i].picks = 0;
   }
-  /* 创建 thread_number 个线程，并设置为脱离线程 */
-  for (int i = 0; i < thread_number; ++i) {
-    // printf("create the %dth thread\n", i);
-    if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-      delete[] m_threads;
-      throw std::exception();
-    }
-    if (pthread_detach(m_threads[i])) {
-      delete[] m_threads;
+  /* 先创建 min_threads 个线程，析构时回收 */
+  m_growlocker.lock();
+  for (int i = 0; i < min_threads; ++i) {
+    if (!spawn()) {
+      m_growlocker.unlock();
       throw std::exception();
     }
   }
+  m_growlocker.unlock();
 }
 
 template <typename T> threadpool<T>::~threadpool() {
-  delete[] m_threads;
+  /* 唤醒所有休眠的线程，等正在处理的任务完成后回收线程 */
+  m_parklocker.lock();
   m_stop = true;
+  m_parkcond.broadcast();
+  m_parklocker.unlock();
+
+  /* 设置 m_stop 之后不会再创建线程，join 时不能持有锁，退出的线程需要加锁 */
+  m_growlocker.lock();
+  int *states = new int[m_max_threads];
+  for (int i = 0; i < m_max_threads; ++i) {
+    states[i] = m_slots[i].state;
+  }
+  m_growlocker.unlock();
+  for (int i = 0; i < m_max_threads; ++i) {
+    if (states[i] != SLOT_FREE) {
+      pthread_join(m_threads[i], NULL);
+    }
+  }
+  delete[] states;
+  delete[] m_threads;
+  delete[] m_slots;
+  for (int i = 0; i < CLASS_NUMBER; ++i) {
+    delete m_workqueue[i];
+  }
 }
 
 template <typename T> bool threadpool<T>::append(T *request) {
-  /* 操作工作队列时一定要加锁，因为它被所有线程共享 */
-  m_queuelocker.lock();
-  if (m_workqueue.size() > m_max_requests) {
-    m_queuelocker.unlock();
+  int request_class = request->classify();
+  /* 工作线程产生的类别0任务优先放入自己的队列，不加锁 */
+  if (request_class == 0 && m_current && m_current->pool == this &&
+      m_current->tasks.push(request)) {
+    notify();
+    return true;
+  }
+
+  /* 添加任务，附带入队时间 */
+  int64_t now = now_us();
+  if (!m_workqueue[request_class]->push(request, now)) {
     return false;
   }
-  /* 添加任务 */
-  m_workqueue.push_back(request);
-  m_queuelocker.unlock();
+  notify();
 
-  /* 信号提醒有任务需要处理 */
-  m_queuestat.post();
+  /* 空闲的线程可能因为给类别0留出的线程而不能处理低优先级的任务，
+   * 这时即使有空闲线程也要检查排队时间 */
+  if (request_class > 0 || m_idle.load(std::memory_order_relaxed) == 0) {
+    check_wait(now);
+  }
   return true;
 }
 
+template <typename T>
+void threadpool<T>::set_class_limit(int request_class, int limit) {
+  if (request_class > 0 && request_class < CLASS_NUMBER && limit > 0) {
+    m_class_limit[request_class] = limit;
+  }
+}
+
 template <typename T> void *threadpool<T>::worker(void *arg) {
 
-  /* 将参数强转为线程池类，调用成员方法 */
-  threadpool *pool = (threadpool *)arg;
-  pool->run();
-  return pool;
+  /* 参数为该线程的队列，从中取得线程池 */
+  worker_slot *self = (worker_slot *)arg;
+  m_current = self;
+  self->pool->run(self);
+  return self->pool;
 }
 
-template <typename T> void threadpool<T>::run() {
+template <typename T> void threadpool<T>::run(worker_slot *self) {
   while (!m_stop) {
-    /* 等待信号量 */
-    m_queuestat.wait();
+    int request_class = 0;
+    T *request = take(self, &request_class);
+    if (!request) {
+      if (!park() && retire(self)) {
+        return;
+      }
+      continue;
+    }
+    /* 交给HTTP处理类，需要数据库的请求在处理时自己获取连接 */
+    request->process();
+    if (request_class > 0) {
+      release(request_class);
+      /* 低优先级的任务可能因为并发限制在排队 */
+      for (int i = 1; i < CLASS_NUMBER; ++i) {
+        if (m_workqueue[i]->size() > 0) {
+          notify();
+          break;
+        }
+      }
+    }
+  }
+}
 
-    /* 被唤醒的先加互斥锁 */
-    m_queuelocker.lock();
-    if (m_workqueue.empty()) {
-      m_queuelocker.unlock();
+template <typename T>
+T *threadpool<T>::take(worker_slot *self, int *request_class) {
+  T *request = NULL;
+  bool lower_first = (++self->picks % LOWER_CLASS_INTERVAL == 0);
+  if (lower_first) {
+    request = take_lower(request_class);
+    if (request) {
+      return request;
+    }
+  }
+  *request_class = 0;
+  request = self->tasks.pop();
+  if (!request) {
+    request = take_injected(self);
+  }
+  if (!request) {
+    request = steal(self);
+  }
+  if (!request && !lower_first) {
+    request = take_lower(request_class);
+  }
+  return request;
+}
+
+template <typename T> T *threadpool<T>::take_lower(int *request_class) {
+  for (int i = 1; i < CLASS_NUMBER; ++i) {
+    /* 先占用一个并发名额，取不到任务时归还 */
+    if (!class_ready(i) || !reserve(i)) {
       continue;
     }
-    /* 从请求队列中取出第一个任务，并将其从请求队列中删除 */
-    T *request = m_workqueue.front();
-    m_workqueue.pop_front();
-    m_queuelocker.unlock();
-    if (!request) {
+    T *request = m_workqueue[i]->pop();
+    if (request) {
+      *request_class = i;
+      return request;
+    }
+    release(i);
+  }
+  return NULL;
+}
+
+template <typename T> bool threadpool<T>::class_ready(int request_class) {
+  int active = m_active.load(std::memory_order_relaxed);
+  return m_workqueue[request_class]->size() > 0 &&
+         m_class_running[request_class].load(std::memory_order_relaxed) <
+             m_class_limit[request_class] &&
+         m_lower_running.load(std::memory_order_relaxed) <
+             (active > 1 ? active - 1 : 1);
+}
+
+template <typename T> bool threadpool<T>::reserve(int request_class) {
+  /* 先加再检查，超出时撤销，多个线程同时占用也不会超过限制 */
+  if (m_class_running[request_class].fetch_add(1) >=
+      m_class_limit[request_class]) {
+    m_class_running[request_class].fetch_sub(1);
+    return false;
+  }
+  int active = m_active.load(std::memory_order_relaxed);
+  if (m_lower_running.fetch_add(1) >= (active > 1 ? active - 1 : 1)) {
+    m_lower_running.fetch_sub(1);
+    m_class_running[request_class].fetch_sub(1);
+    return false;
+  }
+  return true;
+}
+
+template <typename T> void threadpool<T>::release(int request_class) {
+  m_lower_running.fetch_sub(1);
+  m_class_running[request_class].fetch_sub(1);
+}
+
+template <typename T> void threadpool<T>::check_wait(int64_t now) {
+  for (int i = 0; i < CLASS_NUMBER; ++i) {
+    /* 达到自身并发限制的类别，增加线程也无济于事 */
+    if (i > 0 && m_class_running[i].load(std::memory_order_relaxed) >=
+                     m_class_limit[i]) {
       continue;
     }
-    connectionRAII mysqlcon(&request->mysql, m_connPool);
+    int64_t oldest = m_workqueue[i]->front_stamp();
+    if (oldest && now - oldest >= QUEUE_WAIT_TARGET) {
+      maybe_grow(now - oldest, now);
+      return;
+    }
+  }
+}
 
-    /* 交给HTTP处理类 */
-    request->process();
+template <typename T> T *threadpool<T>::take_injected(worker_slot *self) {
+  T *batch[MAX_BATCH];
+  /* 按线程数均分，任务少时每次只取一个，不让一个线程囤积任务 */
+  int active = m_active.load(std::memory_order_relaxed);
+  size_t want = m_workqueue[0]->size() / (active > 0 ? active : 1) + 1;
+  if (want > MAX_BATCH) {
+    want = MAX_BATCH;
+  }
+  int64_t stamp = 0;
+  int n = 0;
+  while (n < (int)want &&
+         (batch[n] = m_workqueue[0]->pop(n == 0 ? &stamp : NULL)) != NULL) {
+    ++n;
+  }
+  if (n == 0) {
+    return NULL;
+  }
+  /* 自己的队列此时为空，放得下一整批。倒序放入，pop 时仍按到达顺序处理 */
+  for (int i = n - 1; i > 0; --i) {
+    self->tasks.push(batch[i]);
+  }
+  if (n > 1) {
+    /* 多出的任务可以被休眠的线程窃取 */
+    notify();
+  }
+  if (m_idle.load(std::memory_order_relaxed) == 0) {
+    int64_t now = now_us();
+    maybe_grow(now - stamp, now);
+  }
+  return batch[0];
+}
+
+template <typename T> T *threadpool<T>::steal(worker_slot *self) {
+  for (int i = 1; i < m_max_threads; ++i) {
+    worker_slot *victim = m_slots + (self->index + i) % m_max_threads;
+    T *request = victim->tasks.steal();
+    if (request) {
+      return request;
+    }
+  }
+  return NULL;
+}
+
+template <typename T> bool threadpool<T>::has_task() {
+  if (m_workqueue[0]->size() > 0) {
+    return true;
+  }
+  for (int i = 1; i < CLASS_NUMBER; ++i) {
+    if (class_ready(i)) {
+      return true;
+    }
+  }
+  for (int i = 0; i < m_max_threads; ++i) {
+    if (!m_slots[i].tasks.empty()) {
+      return true;
+    }
   }
+  return false;
+}
+
+template <typename T> bool threadpool<T>::park() {
+  bool woken = true;
+  m_parklocker.lock();
+  m_idle.fetch_add(1, std::memory_order_relaxed);
+  /* 与 notify 配对：先登记休眠再检查任务，放入任务的一方先发布任务再检查休眠数，
+   * 两者至少有一方看到对方，唤醒不会丢失 */
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!m_stop && !has_task()) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += WORKER_IDLE_TIMEOUT;
+    woken = m_parkcond.timewait(m_parklocker.get(), deadline);
+  }
+  m_idle.fetch_sub(1, std::memory_order_relaxed);
+  m_parklocker.unlock();
+  return woken;
+}
+
+template <typename T> void threadpool<T>::notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_idle.load(std::memory_order_relaxed) > 0) {
+    m_parklocker.lock();
+    m_parkcond.signal();
+    m_parklocker.unlock();
+  }
+}
+
+template <typename T>
+void threadpool<T>::maybe_grow(int64_t wait, int64_t now) {
+  if (wait < QUEUE_WAIT_TARGET ||
+      m_active.load(std::memory_order_relaxed) >= m_max_threads) {
+    return;
+  }
+  /* 限制增长速度，新线程开始取任务之后排队时间才会下降 */
+  int64_t last = m_last_grow.load(std::memory_order_relaxed);
+  if (now - last < GROW_INTERVAL ||
+      !m_last_grow.compare_exchange_strong(last, now)) {
+    return;
+  }
+  m_growlocker.lock();
+  if (!m_stop && m_active.load(std::memory_order_relaxed) < m_max_threads) {
+    spawn();
+  }
+  m_growlocker.unlock();
+}
+
+template <typename T> bool threadpool<T>::spawn() {
+  for (int i = 0; i < m_max_threads; ++i) {
+    worker_slot *slot = m_slots + i;
+    if (slot->state == SLOT_RUNNING) {
+      continue;
+    }
+    if (slot->state == SLOT_RETIRED) {
+      /* 线程已经从 run 返回，join 很快完成 */
+      pthread_join(m_threads[i], NULL);
+      slot->state = SLOT_FREE;
+    }
+    if (pthread_create(m_threads + i, NULL, worker, slot) != 0) {
+      return false;
+    }
+    slot->state = SLOT_RUNNING;
+    m_active.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+template <typename T> bool threadpool<T>::retire(worker_slot *self) {
+  bool retired = false;
+  m_growlocker.lock();
+  /* 自己的队列为空才能退出，其中的任务没有其他线程负责唤醒 */
+  if (!m_stop && m_active.load(std::memory_order_relaxed) > m_min_threads &&
+      self->tasks.empty() && !has_task()) {
+    self->state = SLOT_RETIRED;
+    m_active.fetch_sub(1, std::memory_order_relaxed);
+    retired = true;
+  }
+  m_growlocker.unlock();
+  return retired;
+}
+
+template <typename T> int64_t threadpool<T>::now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -2,44 +2,53 @@
 #define LST_TIMER
 
 #include <time.h>
+#include <stdint.h>
 #include "../log/log.h"
 #include <netinet/in.h>
 
-class util_timer;
-struct client_data
+/* 单调时钟的当前时间(毫秒)，不受系统时间调整影响 */
+inline int64_t monotonic_ms()
 {
-    sockaddr_in address;
-    int sockfd;
-    util_timer *timer;
-};
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct client_data;
 
+/* 定时器节点嵌入在 client_data 中，随连接表中的位置复用，
+ * 定时器容器只负责把节点串起来，不申请也不释放节点 */
 class util_timer
 {
 public:
-    util_timer() : prev(NULL), next(NULL) {}
+    util_timer() : prev(NULL), next(NULL), slot(-1) {}
 
 public:
-    time_t expire;
+    int64_t expire; //到期时间，monotonic_ms() 的值
     void (*cb_func)(client_data *);
     client_data *user_data;
     util_timer *prev;
     util_timer *next;
+    int slot; //在时间轮中所在的槽，链表定时器不使用
+};
+
+struct client_data
+{
+    sockaddr_in address;
+    int sockfd;
+    int epollfd; //所属事件循环的epoll内核事件表
+    util_timer *timer; //指向 timer_node，定时器不在容器中时为 NULL
+    util_timer timer_node;
+    int phase; //连接所处的阶段，决定定时器的超时时间，由事件循环维护
+    bool busy; //连接已交给线程池，尚未交还给事件循环
+    bool expired; //交给线程池期间定时器已到期，交还后关闭
 };
 
 class sort_timer_lst
 {
 public:
     sort_timer_lst() : head(NULL), tail(NULL) {}
-    ~sort_timer_lst()
-    {
-        util_timer *tmp = head;
-        while (tmp)
-        {
-            head = tmp->next;
-            delete tmp;
-            tmp = head;
-        }
-    }
+    ~sort_timer_lst() {}
     void add_timer(util_timer *timer)
     {
         if (!timer)
@@ -66,6 +75,13 @@ public:
         {
             return;
         }
+        /* 各阶段期限不同，到期时间也可能提前，这时摘下后从头部重新插入 */
+        if (timer->prev && timer->expire < timer->prev->expire)
+        {
+            del_timer(timer);
+            add_timer(timer);
+            return;
+        }
         util_timer *tmp = timer->next;
         if (!tmp || (timer->expire < tmp->expire))
         {
@@ -91,30 +107,23 @@ public:
         {
             return;
         }
-        if ((timer == head) && (timer == tail))
+        if (timer->prev)
         {
-            delete timer;
-            head = NULL;
-            tail = NULL;
-            return;
+            timer->prev->next = timer->next;
         }
-        if (timer == head)
+        else
         {
-            head = head->next;
-            head->prev = NULL;
-            delete timer;
-            return;
+            head = timer->next;
         }
-        if (timer == tail)
+        if (timer->next)
         {
-            tail = tail->prev;
-            tail->next = NULL;
-            delete timer;
-            return;
+            timer->next->prev = timer->prev;
+        }
+        else
+        {
+            tail = timer->prev;
         }
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        delete timer;
+        timer->prev = timer->next = NULL;
     }
     void tick()
     {
@@ -122,10 +131,7 @@ public:
         {
             return;
         }
-        //printf( "timer tick\n" );
-        LOG_INFO("%s", "timer tick");
-        Log::get_instance()->flush();
-        time_t cur = time(NULL);
+        int64_t cur = monotonic_ms();
         util_timer *tmp = head;
         while (tmp)
         {
@@ -133,13 +139,9 @@ public:
             {
                 break;
             }
+            /* 先从链表中摘下，回调之后节点所在的连接可能已被回收 */
+            del_timer(tmp);
             tmp->cb_func(tmp->user_data);
-            head = tmp->next;
-            if (head)
-            {
-                head->prev = NULL;
-            }
-            delete tmp;
             tmp = head;
         }
     }
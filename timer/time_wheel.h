@@ -0,0 +1,104 @@
+#ifndef TIME_WHEEL_H
+#define TIME_WHEEL_H
+
+#include "lst_timer.h"
+
+/* 哈希时间轮定时器，接口和回调约定与 sort_timer_lst 相同
+ * 每个槽 SLOT_MS 毫秒，定时器按到期时间所在的槽对槽数取模挂到对应槽的双向链表上，
+ * 添加、调整和删除都是 O(1)，不随连接数增长。
+ * 节点嵌入在 client_data 中，不申请内存。
+ * tick 依次检查上次 tick 之后经过的每个槽，到期时间在之后若干圈的定时器留在原槽中，
+ * 定时精度为一个槽。
+ */
+class time_wheel {
+
+public:
+  time_wheel() : m_cur_slot(monotonic_ms() / SLOT_MS) {
+    for (int i = 0; i < SLOT_NUMBER; ++i) {
+      m_slots[i] = NULL;
+    }
+  }
+  ~time_wheel() {}
+
+  void add_timer(util_timer *timer) {
+    if (!timer) {
+      return;
+    }
+    link(timer);
+  }
+  /* 调用者已经修改了 timer->expire */
+  void adjust_timer(util_timer *timer) {
+    if (!timer) {
+      return;
+    }
+    unlink(timer);
+    link(timer);
+  }
+  void del_timer(util_timer *timer) {
+    if (!timer) {
+      return;
+    }
+    unlink(timer);
+  }
+  void tick() {
+    int64_t cur_slot = monotonic_ms() / SLOT_MS;
+    /* 间隔超过一圈时每个槽只需检查一次 */
+    int count = 0;
+    for (int64_t t = m_cur_slot + 1; t <= cur_slot && count < SLOT_NUMBER;
+         ++t, ++count) {
+      util_timer *tmp = m_slots[t & (SLOT_NUMBER - 1)];
+      while (tmp) {
+        util_timer *next = tmp->next;
+        if (tmp->expire / SLOT_MS <= cur_slot) {
+          /* 先从槽中摘下，回调之后节点所在的连接可能已被回收 */
+          unlink(tmp);
+          tmp->cb_func(tmp->user_data);
+        }
+        tmp = next;
+      }
+    }
+    if (cur_slot > m_cur_slot) {
+      m_cur_slot = cur_slot;
+    }
+  }
+
+private:
+  void link(util_timer *timer) {
+    /* 已经过期的定时器放到下一个要检查的槽 */
+    int64_t expire_slot = timer->expire / SLOT_MS;
+    if (expire_slot <= m_cur_slot) {
+      expire_slot = m_cur_slot + 1;
+    }
+    int slot = expire_slot & (SLOT_NUMBER - 1);
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = m_slots[slot];
+    if (m_slots[slot]) {
+      m_slots[slot]->prev = timer;
+    }
+    m_slots[slot] = timer;
+  }
+  void unlink(util_timer *timer) {
+    if (timer->prev) {
+      timer->prev->next = timer->next;
+    } else {
+      m_slots[timer->slot] = timer->next;
+    }
+    if (timer->next) {
+      timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = NULL;
+  }
+
+private:
+  /* 每个槽的时长(毫秒) */
+  static const int SLOT_MS = 10;
+  /* 槽数，必须是2的幂，一圈约41秒 */
+  static const int SLOT_NUMBER = 4096;
+
+  util_timer *m_slots[SLOT_NUMBER];
+  /* 上次 tick 时所在的槽，之前的槽都已检查过 */
+  int64_t m_cur_slot;
+};
+
+#endif